@@ -35,7 +35,7 @@ if not "%1"=="" goto out
 :enc
 echo.
 set APP_NAME=gust_enc
-cl.exe %APP_NAME%.c util.c parson.c /Fe%APP_NAME%.exe
+cl.exe %APP_NAME%.c gust_enc_lib.c util.c parson.c /Fe%APP_NAME%.exe
 if %ERRORLEVEL% neq 0 goto out
 echo =^> %APP_NAME%.exe
 if not "%1"=="" goto out
@@ -21,15 +21,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#ifndef _WIN32
+#if defined(__linux__)
 #include <unistd.h>
-#define _unlink unlink
 #endif
 
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
 
+#if defined(USE_LIBDEFLATE)
+#include <libdeflate.h>
+#else
 #define MINIZ_NO_STDIO
 #define MINIZ_NO_ARCHIVE_APIS
 #define MINIZ_NO_TIME
@@ -37,6 +39,7 @@
 #define MINIZ_NO_MALLOC
 #include "miniz_tinfl.h"
 #include "miniz_tdef.h"
+#endif
 
 #define EARC_MAGIC              ((uint32_t)'EARC')
 #define DEFAULT_CHUNK_SIZE      0x4000
@@ -59,30 +62,648 @@ typedef struct {
 } lxr_entry;
 #pragma pack(pop)
 
-int main_utf8(int argc, char** argv)
+// Compression backend. Chunks are standalone zlib streams, that any backend can produce
+// or consume, so miniz (the default) and libdeflate (with USE_LIBDEFLATE, on Linux only) are
+// interchangeable.
+#if defined(USE_LIBDEFLATE)
+#define MAX_LEVEL               12
+#define DEFAULT_LEVEL           6
+
+typedef struct libdeflate_decompressor inflater;
+typedef struct libdeflate_compressor deflater;
+
+static __inline inflater* inflater_alloc(void)
+{
+    return libdeflate_alloc_decompressor();
+}
+
+static __inline void inflater_free(inflater* d)
+{
+    if (d != NULL)
+        libdeflate_free_decompressor(d);
+}
+
+// Returns the inflated size, or 0 on error
+static __inline size_t inflate_chunk(inflater* d, void* dst, size_t dst_len, const void* src, size_t src_len)
+{
+    size_t size = 0;
+    if (libdeflate_zlib_decompress(d, src, src_len, dst, dst_len, &size) != LIBDEFLATE_SUCCESS)
+        return 0;
+    return size;
+}
+
+static __inline deflater* deflater_alloc(int level)
+{
+    return libdeflate_alloc_compressor(level);
+}
+
+static __inline void deflater_free(deflater* c)
+{
+    if (c != NULL)
+        libdeflate_free_compressor(c);
+}
+
+// Returns the compressed size, or 0 on error
+static __inline size_t deflate_chunk(deflater* c, void* dst, size_t dst_len, const void* src, size_t src_len)
+{
+    return libdeflate_zlib_compress(c, src, src_len, dst, dst_len);
+}
+#else
+#define MAX_LEVEL               10
+// Level 7 is 256 probes, which is what the original archives use
+#define DEFAULT_LEVEL           7
+
+typedef tinfl_decompressor inflater;
+typedef struct {
+    tdefl_compressor compressor;
+    mz_uint flags;
+} deflater;
+
+static __inline inflater* inflater_alloc(void)
+{
+    return malloc(sizeof(inflater));
+}
+
+static __inline void inflater_free(inflater* d)
+{
+    free(d);
+}
+
+static __inline size_t inflate_chunk(inflater* d, void* dst, size_t dst_len, const void* src, size_t src_len)
+{
+    tinfl_init(d);
+    tinfl_status status = tinfl_decompress(d, (const mz_uint8*)src, &src_len, (mz_uint8*)dst, (mz_uint8*)dst,
+        &dst_len, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    return (status == TINFL_STATUS_DONE) ? dst_len : 0;
+}
+
+static __inline deflater* deflater_alloc(int level)
+{
+    deflater* c = malloc(sizeof(deflater));
+    if (c != NULL)
+        c->flags = tdefl_create_comp_flags_from_zip_params(level, 15, 0) | TDEFL_COMPUTE_ADLER32;
+    return c;
+}
+
+static __inline void deflater_free(deflater* c)
+{
+    free(c);
+}
+
+static __inline size_t deflate_chunk(deflater* c, void* dst, size_t dst_len, const void* src, size_t src_len)
+{
+    if ((tdefl_init(&c->compressor, NULL, NULL, c->flags) != TDEFL_STATUS_OKAY) ||
+        (tdefl_compress(&c->compressor, src, &src_len, dst, &dst_len, TDEFL_FINISH) != TDEFL_STATUS_DONE))
+        return 0;
+    return dst_len;
+}
+#endif
+
+// Number of chunks each thread inflates in one go, when inflating in parallel
+#define CHUNKS_PER_THREAD       64
+// Each thread needs a window of 1 MB, so we don't go beyond a reasonable number
+#define MAX_THREADS             256
+
+// Sequential reader for the uncompressed content of an elixir archive. For .elixir.gz,
+// the zlib chunks are inflated one at a time, so that memory usage doesn't depend on
+// the size of the archive. If the archive can be mapped, chunks can also be inflated
+// in parallel, one window of chunks at a time.
+typedef struct {
+    FILE*    file;
+    bool     compressed;
+    bool     eof;
+    const uint8_t* data;    // Inflated data of the current chunk
+    uint8_t* chunk;
+    uint32_t chunk_size;
+    uint32_t chunk_pos;
+    uint8_t* zbuf;          // Compressed data of the current chunk, reused across chunks
+    uint32_t zbuf_size;
+    inflater* inflater;
+    uint64_t pos;           // Position in the uncompressed data
+    bool     verify;        // Check that the chunks are the ones the game expects
+    uint32_t nb_read_chunks;
+    uint32_t last_chunk_size;
+    // Parallel inflating
+    const mapped_file* map;
+    uint64_t* zoffsets;     // Offset and size of each compressed chunk in the mapping
+    uint32_t* zsizes;
+    uint32_t nb_chunks;
+    uint32_t next_chunk;
+    uint32_t nb_threads;
+    uint8_t* window;        // Inflated data for the chunks of the current window
+    uint32_t* window_sizes;
+    uint32_t window_start;
+    uint32_t window_count;
+    volatile uint32_t next_job;
+    volatile uint32_t nb_errors;
+} lxr_stream;
+
+static bool lxr_open(lxr_stream* s, FILE* file, bool compressed)
+{
+    memset(s, 0, sizeof(*s));
+    s->file = file;
+    s->compressed = compressed;
+    s->chunk = malloc(DEFAULT_CHUNK_SIZE);
+    if (compressed)
+        s->inflater = inflater_alloc();
+    return (s->chunk != NULL) && (!compressed || (s->inflater != NULL));
+}
+
+// Switch a compressed stream to parallel inflating of the chunks from a mapping
+static bool lxr_map(lxr_stream* s, const mapped_file* map, uint32_t nb_threads)
+{
+    uint32_t max_chunks = 0;
+    uint64_t pos = 0;
+
+    // Scan the chunk sizes, so that we know where each chunk starts
+    while (1) {
+        if (pos + sizeof(uint32_t) > map->size) {
+            fprintf(stderr, "ERROR: Can't read compressed stream size at position %08x\n", (uint32_t)pos);
+            return false;
+        }
+        uint32_t zsize = getle32(&map->data[pos]);
+        pos += sizeof(uint32_t);
+        if (zsize == 0)
+            break;
+        if (pos + zsize > map->size) {
+            fprintf(stderr, "ERROR: Can't read compressed stream at position %08x\n", (uint32_t)pos - 4);
+            return false;
+        }
+        if (s->nb_chunks >= max_chunks) {
+            max_chunks = (max_chunks == 0) ? 1024 : 2 * max_chunks;
+            uint64_t* zoffsets = realloc(s->zoffsets, max_chunks * sizeof(uint64_t));
+            if (zoffsets != NULL)
+                s->zoffsets = zoffsets;
+            uint32_t* zsizes = realloc(s->zsizes, max_chunks * sizeof(uint32_t));
+            if (zsizes != NULL)
+                s->zsizes = zsizes;
+            if ((zoffsets == NULL) || (zsizes == NULL)) {
+                fprintf(stderr, "ERROR: Can't allocate chunk table\n");
+                return false;
+            }
+        }
+        s->zoffsets[s->nb_chunks] = pos;
+        s->zsizes[s->nb_chunks++] = zsize;
+        pos += zsize;
+    }
+
+    s->window = malloc((size_t)nb_threads * CHUNKS_PER_THREAD * DEFAULT_CHUNK_SIZE);
+    s->window_sizes = calloc((size_t)nb_threads * CHUNKS_PER_THREAD, sizeof(uint32_t));
+    if ((s->window == NULL) || (s->window_sizes == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate inflate window\n");
+        return false;
+    }
+    s->map = map;
+    s->nb_threads = nb_threads;
+    return true;
+}
+
+static void lxr_close(lxr_stream* s)
+{
+    free(s->chunk);
+    free(s->zbuf);
+    inflater_free(s->inflater);
+    free(s->zoffsets);
+    free(s->zsizes);
+    free(s->window);
+    free(s->window_sizes);
+    memset(s, 0, sizeof(*s));
+}
+
+// Inflating worker. Each chunk is a separate zlib stream and goes to its own slot.
+static void inflate_worker(void* arg)
+{
+    lxr_stream* s = (lxr_stream*)arg;
+    inflater* d = inflater_alloc();
+    if (d == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate decompressor\n");
+        atomic_fetch_inc(&s->nb_errors);
+        return;
+    }
+    for (uint32_t i = atomic_fetch_inc(&s->next_job); i < s->window_count; i = atomic_fetch_inc(&s->next_job)) {
+        uint32_t c = s->window_start + i;
+        size_t size = inflate_chunk(d, &s->window[(size_t)i * DEFAULT_CHUNK_SIZE], DEFAULT_CHUNK_SIZE,
+            &s->map->data[s->zoffsets[c]], s->zsizes[c]);
+        if (size == 0) {
+            fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n", (uint32_t)s->zoffsets[c] - 4);
+            atomic_fetch_inc(&s->nb_errors);
+            size = 0;
+        }
+        s->window_sizes[i] = (uint32_t)size;
+    }
+    inflater_free(d);
+}
+
+// The game expects every chunk but the last one to inflate to DEFAULT_CHUNK_SIZE. We
+// can read chunks of any size that fits our buffer, so this is only checked with -t.
+static bool lxr_check_chunk(lxr_stream* s, uint32_t size)
+{
+    if (s->verify && (s->nb_read_chunks != 0) && (s->last_chunk_size != DEFAULT_CHUNK_SIZE)) {
+        fprintf(stderr, "ERROR: Chunk %u inflates to 0x%x bytes instead of 0x%x\n",
+            s->nb_read_chunks - 1, s->last_chunk_size, DEFAULT_CHUNK_SIZE);
+        return false;
+    }
+    s->nb_read_chunks++;
+    s->last_chunk_size = size;
+    return true;
+}
+
+// Fill the chunk buffer with the next chunk of data
+static bool lxr_fill(lxr_stream* s)
+{
+    uint32_t zsize, file_pos;
+
+    s->chunk_pos = 0;
+    s->chunk_size = 0;
+    s->data = s->chunk;
+    if ((s->map != NULL) && !s->compressed) {
+        // Plain archives that are mapped are accessed in place, as one large chunk
+        s->eof = (s->pos >= s->map->size);
+        if (!s->eof) {
+            s->data = &s->map->data[s->pos];
+            s->chunk_size = (uint32_t)min(s->map->size - s->pos, (uint64_t)0x40000000);
+        }
+        return true;
+    }
+    if (s->map != NULL) {
+        if (s->next_chunk >= s->nb_chunks) {
+            s->eof = true;
+            return true;
+        }
+        if (s->next_chunk >= s->window_start + s->window_count) {
+            s->window_start = s->next_chunk;
+            s->window_count = min(s->nb_chunks - s->next_chunk, s->nb_threads * CHUNKS_PER_THREAD);
+            s->next_job = 0;
+            run_threads(min(s->nb_threads, s->window_count), inflate_worker, s);
+            if (s->nb_errors != 0)
+                return false;
+        }
+        s->data = &s->window[(size_t)(s->next_chunk - s->window_start) * DEFAULT_CHUNK_SIZE];
+        s->chunk_size = s->window_sizes[s->next_chunk++ - s->window_start];
+        return lxr_check_chunk(s, s->chunk_size);
+    }
+    file_pos = (uint32_t)ftell(s->file);
+    if (!s->compressed) {
+        s->chunk_size = (uint32_t)fread(s->chunk, 1, DEFAULT_CHUNK_SIZE, s->file);
+        s->eof = (s->chunk_size == 0);
+        return true;
+    }
+    if (fread(&zsize, sizeof(uint32_t), 1, s->file) != 1) {
+        fprintf(stderr, "ERROR: Can't read compressed stream size at position %08x\n", file_pos);
+        return false;
+    }
+    if (zsize == 0) {
+        s->eof = true;
+        return true;
+    }
+    if (zsize > s->zbuf_size) {
+        free(s->zbuf);
+        s->zbuf = malloc(zsize);
+        s->zbuf_size = (s->zbuf == NULL) ? 0 : zsize;
+        if (s->zbuf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate compressed stream buffer\n");
+            return false;
+        }
+    }
+    if (fread(s->zbuf, 1, zsize, s->file) != zsize) {
+        fprintf(stderr, "ERROR: Can't read compressed stream at position %08x\n", file_pos);
+        return false;
+    }
+    // Elixirs are compressed using a constant chunk size, so a chunk should always fit
+    size_t size = inflate_chunk(s->inflater, s->chunk, DEFAULT_CHUNK_SIZE, s->zbuf, zsize);
+    if (size == 0) {
+        fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n", file_pos);
+        return false;
+    }
+    s->chunk_size = (uint32_t)size;
+    return lxr_check_chunk(s, s->chunk_size);
+}
+
+// Process the next len bytes of data, by copying them to dst and/or writing them to file.
+static bool lxr_process(lxr_stream* s, uint8_t* dst, FILE* file, uint64_t len)
+{
+    while (len > 0) {
+        if (s->chunk_pos >= s->chunk_size) {
+            if (!lxr_fill(s))
+                return false;
+            if (s->eof) {
+                fprintf(stderr, "ERROR: Unexpected end of data\n");
+                return false;
+            }
+        }
+        uint32_t n = (uint32_t)min(len, (uint64_t)(s->chunk_size - s->chunk_pos));
+        if (dst != NULL) {
+            memcpy(dst, &s->data[s->chunk_pos], n);
+            dst += n;
+        }
+        if ((file != NULL) && (fwrite(&s->data[s->chunk_pos], 1, n, file) != n)) {
+            fprintf(stderr, "ERROR: Can't write data\n");
+            return false;
+        }
+        s->chunk_pos += n;
+        s->pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static __inline bool lxr_read(lxr_stream* s, void* dst, uint64_t len)
+{
+    return lxr_process(s, (uint8_t*)dst, NULL, len);
+}
+
+// Skip the next len bytes of data. Uncompressed data can be skipped without being read,
+// but compressed chunks must still be inflated, as this is the only way to find how much
+// data they hold.
+static bool lxr_skip(lxr_stream* s, uint64_t len)
+{
+    if (!s->compressed && (s->map == NULL) && (len > (uint64_t)(s->chunk_size - s->chunk_pos))) {
+        len -= s->chunk_size - s->chunk_pos;
+        s->pos += s->chunk_size - s->chunk_pos;
+        s->chunk_pos = s->chunk_size;
+        if (fseek64(s->file, len, SEEK_CUR) != 0) {
+            fprintf(stderr, "ERROR: Can't seek data\n");
+            return false;
+        }
+        s->pos += len;
+        return true;
+    }
+    return lxr_process(s, NULL, NULL, len);
+}
+
+// Go back to the start of the data, for entries whose data we have already gone past
+static bool lxr_rewind(lxr_stream* s)
+{
+    if (fseek64(s->file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: Can't seek data\n");
+        return false;
+    }
+    s->eof = false;
+    s->chunk_size = 0;
+    s->chunk_pos = 0;
+    s->pos = 0;
+    s->nb_read_chunks = 0;
+    s->last_chunk_size = 0;
+    s->next_chunk = 0;
+    s->window_start = 0;
+    s->window_count = 0;
+    return true;
+}
+
+static bool lxr_copy_to_file(lxr_stream* s, uint64_t len, const char* path)
+{
+    FILE* file = fopen_utf8(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+#if defined(__linux__)
+    // When the data is in place, let the kernel copy it if the filesystem allows it
+    if (!s->compressed && (s->map != NULL) && (s->chunk_pos < s->chunk_size)) {
+        off64_t src_offset = (off64_t)s->pos;
+        while (len > 0) {
+            ssize_t n = copy_file_range(fileno(s->file), &src_offset, fileno(file), NULL,
+                (size_t)min(len, (uint64_t)(s->chunk_size - s->chunk_pos)), 0);
+            if (n <= 0)
+                break;
+            s->chunk_pos += (uint32_t)n;
+            s->pos += (uint64_t)n;
+            len -= (uint64_t)n;
+        }
+    }
+#endif
+    bool r = lxr_process(s, NULL, file, len);
+    fclose(file);
+    return r;
+}
+
+// Check that we have reached the end of the data
+static bool lxr_at_end(lxr_stream* s)
+{
+    if (s->chunk_pos < s->chunk_size)
+        return false;
+    return lxr_fill(s) && s->eof;
+}
+
+// Maximum size of a compressed chunk. Incompressible data ends up slightly larger.
+#define MAX_ZCHUNK_SIZE         (DEFAULT_CHUNK_SIZE + 0x100)
+
+// Chunked writer for .elixir.gz. Data is accumulated into a window of chunks, which
+// are then compressed in parallel, each as a separate zlib stream, and written in order.
+// For plain .elixir, the window is only used as a buffer to copy data to the file.
+typedef struct {
+    FILE*    file;
+    bool     compressed;
+    uint32_t nb_threads;
+    deflater** compressors;
+    uint8_t* window;            // Uncompressed data
+    uint32_t window_size;
+    uint8_t* zwindow;           // Compressed data, MAX_ZCHUNK_SIZE per chunk
+    uint32_t* zsizes;
+    uint32_t nb_chunks;
+    volatile uint32_t next_thread;
+    volatile uint32_t next_job;
+    volatile uint32_t nb_errors;
+} lxr_writer;
+
+static bool lxw_open(lxr_writer* w, FILE* file, bool compressed, int level, uint32_t nb_threads)
+{
+    uint32_t max_chunks = nb_threads * CHUNKS_PER_THREAD;
+    memset(w, 0, sizeof(*w));
+    w->file = file;
+    w->compressed = compressed;
+    w->window = malloc((size_t)max_chunks * DEFAULT_CHUNK_SIZE);
+    if (w->window == NULL)
+        return false;
+    if (!compressed)
+        return true;
+    w->nb_threads = nb_threads;
+    w->compressors = calloc(nb_threads, sizeof(deflater*));
+    w->zwindow = malloc((size_t)max_chunks * MAX_ZCHUNK_SIZE);
+    w->zsizes = calloc(max_chunks, sizeof(uint32_t));
+    if ((w->compressors == NULL) || (w->zwindow == NULL) || (w->zsizes == NULL))
+        return false;
+    for (uint32_t i = 0; i < nb_threads; i++) {
+        w->compressors[i] = deflater_alloc(level);
+        if (w->compressors[i] == NULL)
+            return false;
+    }
+    return true;
+}
+
+static void lxw_close(lxr_writer* w)
+{
+    for (uint32_t i = 0; (w->compressors != NULL) && (i < w->nb_threads); i++)
+        deflater_free(w->compressors[i]);
+    free(w->compressors);
+    free(w->window);
+    free(w->zwindow);
+    free(w->zsizes);
+    memset(w, 0, sizeof(*w));
+}
+
+// Compression worker. Each thread takes a compressor, then compresses chunks with it.
+static void deflate_worker(void* arg)
+{
+    lxr_writer* w = (lxr_writer*)arg;
+    deflater* compressor = w->compressors[atomic_fetch_inc(&w->next_thread)];
+    for (uint32_t i = atomic_fetch_inc(&w->next_job); i < w->nb_chunks; i = atomic_fetch_inc(&w->next_job)) {
+        size_t size = min(w->window_size - i * DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE);
+        size_t zsize = deflate_chunk(compressor, &w->zwindow[(size_t)i * MAX_ZCHUNK_SIZE], MAX_ZCHUNK_SIZE,
+            &w->window[(size_t)i * DEFAULT_CHUNK_SIZE], size);
+        if (zsize == 0)
+            atomic_fetch_inc(&w->nb_errors);
+        w->zsizes[i] = (uint32_t)zsize;
+    }
+}
+
+// Compress and write all the data accumulated in the window
+static bool lxw_flush(lxr_writer* w)
+{
+    if (w->window_size == 0)
+        return true;
+    if (!w->compressed) {
+        if (fwrite(w->window, 1, w->window_size, w->file) != w->window_size) {
+            fprintf(stderr, "ERROR: Can't write data\n");
+            return false;
+        }
+        w->window_size = 0;
+        return true;
+    }
+    w->nb_chunks = (w->window_size + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE;
+    w->next_thread = 0;
+    w->next_job = 0;
+    run_threads(min(w->nb_threads, w->nb_chunks), deflate_worker, w);
+    if (w->nb_errors != 0) {
+        fprintf(stderr, "ERROR: Can't compress data\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < w->nb_chunks; i++) {
+        if (fwrite(&w->zsizes[i], sizeof(uint32_t), 1, w->file) != 1) {
+            fprintf(stderr, "ERROR: Can't write compressed stream size\n");
+            return false;
+        }
+        if (fwrite(&w->zwindow[(size_t)i * MAX_ZCHUNK_SIZE], 1, w->zsizes[i], w->file) != w->zsizes[i]) {
+            fprintf(stderr, "ERROR: Can't write compressed data\n");
+            return false;
+        }
+    }
+    w->window_size = 0;
+    return true;
+}
+
+// Add data, either from memory or, if data is NULL, from a file
+static bool lxw_write(lxr_writer* w, const void* data, FILE* src, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    size_t max_size = (size_t)max(w->nb_threads, 1) * CHUNKS_PER_THREAD * DEFAULT_CHUNK_SIZE;
+    while (len > 0) {
+        uint32_t n = (uint32_t)min(len, max_size - w->window_size);
+        if (p != NULL) {
+            memcpy(&w->window[w->window_size], p, n);
+            p += n;
+        } else if (fread(&w->window[w->window_size], 1, n, src) != n) {
+            fprintf(stderr, "ERROR: Can't read file data\n");
+            return false;
+        }
+        w->window_size += n;
+        len -= n;
+        if ((w->window_size == max_size) && !lxw_flush(w))
+            return false;
+    }
+    return true;
+}
+
+// Write any remaining data, followed by the end marker if compressed
+static bool lxw_finish(lxr_writer* w)
+{
+    uint32_t end_marker = 0;
+    if (!lxw_flush(w))
+        return false;
+    if (!w->compressed)
+        return true;
+    if (fwrite(&end_marker, sizeof(uint32_t), 1, w->file) != 1) {
+        fprintf(stderr, "ERROR: Can't write end marker\n");
+        return false;
+    }
+    return true;
+}
+
+static int compare_entry_offsets(const void* a, const void* b)
+{
+    const lxr_entry* ea = *(const lxr_entry**)a;
+    const lxr_entry* eb = *(const lxr_entry**)b;
+    return (ea->offset < eb->offset) ? -1 : ((ea->offset > eb->offset) ? 1 : 0);
+}
+
+static int process_file(int argc, char** argv)
 {
     int r = -1;
     char path[256];
-    uint8_t *buf = NULL, *zbuf = NULL;
+    uint8_t* table = NULL;
     uint32_t zsize, lxr_entry_size = sizeof(lxr_entry);
+    lxr_entry** sorted = NULL;
+    lxr_stream stream = { 0 };
+    lxr_writer writer = { 0 };
     FILE *file = NULL, *dst = NULL;
     JSON_Value* json = NULL;
-    tdefl_compressor* compressor = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
+    mapped_file map = { 0 };
+    bool list_only = false, check_only = false;
+    uint32_t nb_threads = 1, nb_patterns = 0;
+    const char** patterns = calloc(argc, sizeof(char*));
+    int argn, level = DEFAULT_LEVEL;
+
+    if (patterns == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate patterns\n");
+        return -1;
+    }
 
-    if ((argc != 2) && !list_only) {
+    for (argn = 1; (argn < argc - 1) && (argv[argn][0] == '-'); argn++) {
+        if (argv[argn][1] == 'l') {
+            list_only = true;
+        } else if (argv[argn][1] == 't') {
+            check_only = true;
+        } else if (argv[argn][1] == 'x') {
+            // If a value is missing, the file is used instead, and we display the usage
+            patterns[nb_patterns++] = (argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn];
+        } else if (argv[argn][1] == 'j') {
+            nb_threads = (uint32_t)strtoul((argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn], NULL, 0);
+            if (nb_threads == 0)
+                nb_threads = get_nb_cores();
+            nb_threads = min(nb_threads, MAX_THREADS);
+        } else if (argv[argn][1] == 'z') {
+            level = (int)strtol((argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn], NULL, 0);
+            level = max(min(level, MAX_LEVEL), 0);
+        } else {
+            break;
+        }
+    }
+
+    if (argn != argc - 1) {
         printf("%s %s (c) 2019-2020 VitaSmith\n\n"
-            "Usage: %s [-l] <elixir[.gz]> file>\n\n"
+            "Usage: %s [-l] [-t] [-j N] [-x PATTERN] [-z N] <elixir[.gz]> file> [...]\n\n"
             "Extracts (file) or recreates (directory) a Gust .elixir archive.\n\n"
+            "Options:\n"
+            "  -l          List the content of the archive\n"
+            "  -t          Check that the archive is valid and can be read by the game,\n"
+            "              and report the decompression speed, without extracting\n"
+            "  -j N        Decompress or compress using N threads (0 = one per CPU core)\n"
+            "  -x PATTERN  Only list or extract the entries matching PATTERN, where '*'\n"
+            "              and '?' can be used as wildcards. Can be repeated.\n"
+            "  -z N        Compression level, from 0 (none) to %d (slowest), when\n"
+            "              recreating a compressed archive. Default is %d.\n\n"
+            "Several files can be processed at once, with @LIST reading the list of files\n"
+            "from LIST and '-' reading it from stdin.\n\n"
             "Note: A backup (.bak) of the original is automatically created, when the target\n"
             "is being overwritten for the first time.\n",
-            appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]));
+            appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]), MAX_LEVEL, DEFAULT_LEVEL);
+        free(patterns);
         return 0;
     }
 
     if (is_directory(argv[argc - 1])) {
-        if (list_only) {
-            fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
+        if (list_only || check_only || (nb_patterns != 0)) {
+            fprintf(stderr, "ERROR: Options -l, -t and -x are not supported when creating an archive\n");
             goto out;
         }
         snprintf(path, sizeof(path), "%s%celixir.json", argv[argc - 1], PATH_SEP);
@@ -99,19 +720,6 @@ int main_utf8(int argc, char** argv)
         const char* filename = json_object_get_string(json_object(json), "name");
         if (filename == NULL)
             goto out;
-        printf("Creating '%s'...\n", filename);
-        create_backup(filename);
-        // Work with a temporary file if we're going to compress it
-        if (json_object_get_boolean(json_object(json), "compressed"))
-            snprintf(path, sizeof(path), "%s.tmp", filename);
-        else
-            strncpy(path, filename, sizeof(path));
-        path[sizeof(path) - 1] = 0;
-        file = fopen_utf8(path, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-            goto out;
-        }
         lxr_header hdr = { 0 };
         hdr.magic = EARC_MAGIC;
         hdr.filename_size = json_object_get_uint32(json_object(json),
@@ -121,10 +729,6 @@ int main_utf8(int argc, char** argv)
         hdr.flags = json_object_get_uint32(json_object(json), "flags");
         hdr.header_size = json_object_get_uint32(json_object(json), "header_size");
         hdr.table_size = json_object_get_uint32(json_object(json), "table_size");
-        if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write header\n");
-            goto out;
-        }
         if (hdr.nb_files * lxr_entry_size != hdr.table_size) {
             fprintf(stderr, "ERROR: Unexpected size for offset table\n");
             goto out;
@@ -135,103 +739,75 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
 
-        lxr_entry* table = (lxr_entry*)calloc(hdr.nb_files, lxr_entry_size);
-        // Allocate the space in file - we'll update it later on
-        if (fwrite(table, lxr_entry_size, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write header table\n");
-            free(table);
+        // The size of every file is known, so we can build the table before adding
+        // any data, and stream the whole archive, compressed or not, in one go.
+        table = calloc(max(hdr.nb_files, 1), lxr_entry_size);
+        if (table == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate table\n");
             goto out;
         }
+        uint64_t offset = sizeof(lxr_header) + (uint64_t)hdr.table_size;
+        printf("Creating '%s'...\n", filename);
         printf("OFFSET   SIZE     NAME\n");
-        lxr_entry* entry = table;
         for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            entry->offset = ftell(file);
+            lxr_entry* entry = (lxr_entry*)&table[(size_t)i * lxr_entry_size];
+            struct stat64 st;
             snprintf(path, sizeof(path), "%s%c%s", basename(argv[argc - 1]), PATH_SEP,
                 json_array_get_string(json_files_array, i));
-            entry->size = read_file(path, &buf);
-            if (entry->size == 0) {
-                free(table);
+            if ((stat64_utf8(path, &st) != 0) || (st.st_size == 0)) {
+                fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+                goto out;
+            }
+            if (offset + st.st_size > UINT32_MAX) {
+                fprintf(stderr, "ERROR: Archive is too large\n");
                 goto out;
             }
+            entry->offset = (uint32_t)offset;
+            entry->size = (uint32_t)st.st_size;
+            offset += entry->size;
             strncpy(entry->filename, json_array_get_string(json_files_array, i),
                 0x20 + ((size_t)hdr.filename_size << 4));
             printf("%08x %08x %s\n", entry->offset, entry->size, path);
-            if (fwrite(buf, 1, entry->size, file) != entry->size) {
-                fprintf(stderr, "ERROR: Can't add file data\n");
-                free(table);
-                goto out;
-            }
-            free(buf);
-            buf = NULL;
-            entry = (lxr_entry*) &((uint8_t*)entry)[lxr_entry_size];
-        }
-        hdr.payload_size = ftell(file) - hdr.header_size - hdr.table_size;
-        fseek(file, 2 * sizeof(uint32_t), SEEK_SET);
-        if (fwrite(&hdr.payload_size, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't update file size\n");
-            free(table);
+        }
+        hdr.payload_size = (uint32_t)(offset - hdr.header_size - hdr.table_size);
+
+        create_backup(filename);
+        file = fopen_utf8(filename, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", filename);
             goto out;
         }
-        fseek(file, hdr.header_size, SEEK_SET);
-        if (fwrite(table, lxr_entry_size, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write header table\n");
-            free(table);
+        bool compressed = json_object_get_boolean(json_object(json), "compressed");
+        if (!lxw_open(&writer, file, compressed, level, nb_threads)) {
+            fprintf(stderr, "ERROR: Can't allocate compressor\n");
             goto out;
         }
-        free(table);
-
-        if (json_object_get_boolean(json_object(json), "compressed")) {
+        if (compressed)
             printf("Compressing...\n");
-            compressor = calloc(1, sizeof(tdefl_compressor));
-            if (compressor == NULL)
-                goto out;
-            dst = fopen_utf8(filename, "wb");
-            if (dst == NULL) {
-                fprintf(stderr, "ERROR: Can't create compressed file\n");
+        if (!lxw_write(&writer, &hdr, NULL, sizeof(hdr)) || !lxw_write(&writer, table, NULL, hdr.table_size))
+            goto out;
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            lxr_entry* entry = (lxr_entry*)&table[(size_t)i * lxr_entry_size];
+            snprintf(path, sizeof(path), "%s%c%s", basename(argv[argc - 1]), PATH_SEP,
+                json_array_get_string(json_files_array, i));
+            FILE* src = fopen_utf8(path, "rb");
+            if (src == NULL) {
+                fprintf(stderr, "ERROR: Can't open '%s'\n", path);
                 goto out;
             }
-            fseek(file, 0, SEEK_SET);
-            buf = malloc(DEFAULT_CHUNK_SIZE);
-            zbuf = malloc(DEFAULT_CHUNK_SIZE);
-            while (1) {
-                size_t written = DEFAULT_CHUNK_SIZE;
-                size_t read = fread(buf, 1, DEFAULT_CHUNK_SIZE, file);
-                if (read == 0)
-                    break;
-                tdefl_status status = tdefl_init(compressor, NULL, NULL,
-                    TDEFL_WRITE_ZLIB_HEADER | TDEFL_COMPUTE_ADLER32 | 256);
-                if (status != TDEFL_STATUS_OKAY) {
-                    fprintf(stderr, "ERROR: Can't init compressor\n");
-                    goto out;
-                }
-                status = tdefl_compress(compressor, buf, &read, zbuf, &written, TDEFL_FINISH);
-                if (status != TDEFL_STATUS_DONE) {
-                    fprintf(stderr, "ERROR: Can't compress data\n");
-                    goto out;
-                }
-                if (fwrite(&written, sizeof(uint32_t), 1, dst) != 1) {
-                    fprintf(stderr, "ERROR: Can't write compressed stream size\n");
-                    goto out;
-                }
-                if (fwrite(zbuf, 1, written, dst) != written) {
-                    fprintf(stderr, "ERROR: Can't write compressed data\n");
-                    goto out;
-                }
-            }
-            uint32_t end_marker = 0;
-            if (fwrite(&end_marker, sizeof(uint32_t), 1, dst) != 1) {
-                fprintf(stderr, "ERROR: Can't write end marker\n");
+            bool added = lxw_write(&writer, NULL, src, entry->size);
+            fclose(src);
+            if (!added)
                 goto out;
-            }
-            fclose(file);
-            file = NULL;
-            snprintf(path, sizeof(path), "%s.tmp", filename);
-            _unlink(path);
         }
+        if (!lxw_finish(&writer))
+            goto out;
 
         r = 0;
     } else {
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", basename(argv[argc - 1]));
+        printf("%s '%s'...\n", list_only ? "Listing" : (check_only ? "Checking" : "Extracting"),
+            basename(argv[argc - 1]));
+        uint64_t start_time = get_time_us();
         char* elixir_pos = strstr(argv[argc - 1], ".elixir");
         if (elixir_pos == NULL) {
             fprintf(stderr, "ERROR: File should have a '.elixir[.gz]' extension\n");
@@ -253,137 +829,155 @@ int main_utf8(int argc, char** argv)
         if ((zsize == EARC_MAGIC) && (gz_pos != NULL))
             gz_pos = NULL;
 
-        fseek(file, 0L, SEEK_END);
-        size_t file_size = ftell(file);
         fseek(file, 0L, SEEK_SET);
-
-        if (gz_pos != NULL) {
-            file_size *= 2;
-            buf = malloc(file_size);
-            if (buf == NULL)
-                goto out;
-            size_t pos = 0;
-            while (1) {
-                uint32_t file_pos = (uint32_t)ftell(file);
-                if (fread(&zsize, sizeof(uint32_t), 1, file) != 1) {
-                    fprintf(stderr, "ERROR: Can't read compressed stream size at position %08x\n", file_pos);
-                    goto out;
-                }
-                if (zsize == 0)
-                    break;
-                zbuf = malloc(zsize);
-                if (zbuf == NULL)
-                    goto out;
-                if (fread(zbuf, 1, zsize, file) != zsize) {
-                    fprintf(stderr, "ERROR: Can't read compressed stream at position %08x\n", file_pos);
-                    goto out;
-                }
-                // Elixirs are inflated using a constant chunk size which simplifies overflow handling
-                if (pos + DEFAULT_CHUNK_SIZE > file_size) {
-                    file_size *= 2;
-                    uint8_t* old_buf = buf;
-                    buf = realloc(buf, file_size);
-                    if (buf == NULL) {
-                        fprintf(stderr, "ERROR: Can't increase buffer size\n");
-                        buf = old_buf;
-                        goto out;
-                    }
-                }
-                size_t s = tinfl_decompress_mem_to_mem(&buf[pos], file_size - pos, zbuf, zsize,
-                    TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32);
-                if ((s == 0) || (s == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED)) {
-                    fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n", file_pos);
-                    goto out;
-                }
-                free(zbuf);
-                zbuf = NULL;
-                pos += s;
-            } while (zsize != 0);
-            file_size = pos;
+        if (!lxr_open(&stream, file, (gz_pos != NULL))) {
+            fprintf(stderr, "ERROR: Can't allocate stream\n");
+            goto out;
+        }
+        // Inflate chunks in parallel if we can map the archive, and use plain archives
+        // in place. Otherwise, we just read through the file. Listing only needs the
+        // header and table, so there's no point in inflating ahead.
+        if ((gz_pos == NULL) && map_file(argv[argc - 1], &map))
+            stream.map = &map;
+        else if ((gz_pos != NULL) && !list_only && (nb_threads > 1) && map_file(argv[argc - 1], &map) &&
+            !lxr_map(&stream, &map, nb_threads))
+            goto out;
+        stream.verify = check_only;
 
 //#define DECOMPRESS_ONLY
 #ifdef DECOMPRESS_ONLY
-            if (!list_only) {
-                FILE* dst = NULL;
-                *gz_pos = 0;
-                dst = fopen(argv[argc - 1], "wb");
-                if (dst == NULL) {
-                    fprintf(stderr, "ERROR: Can't create file '%s'\n", argv[argc - 1]);
-                    goto out;
-                }
-                if (fwrite(buf, 1, file_size, dst) != file_size) {
+        if (!list_only && (gz_pos != NULL)) {
+            *gz_pos = 0;
+            dst = fopen(argv[argc - 1], "wb");
+            if (dst == NULL) {
+                fprintf(stderr, "ERROR: Can't create file '%s'\n", argv[argc - 1]);
+                goto out;
+            }
+            while (lxr_fill(&stream) && !stream.eof) {
+                if (fwrite(stream.data, 1, stream.chunk_size, dst) != stream.chunk_size) {
                     fprintf(stderr, "ERROR: Can't write file '%s'\n", argv[argc - 1]);
-                    fclose(dst);
                     goto out;
                 }
-                printf("%08x %s\n", (uint32_t)file_size, basename(argv[argc - 1]));
-                fclose(dst);
-                r = 0;
-                goto out;
+                stream.pos += stream.chunk_size;
             }
-#endif
-        } else {
-            buf = malloc(file_size);
-            if (buf == NULL)
+            if (!stream.eof)
                 goto out;
-            if (fread(buf, 1, file_size, file) != file_size) {
-                fprintf(stderr, "ERROR: Can't read uncompressed data");
-                goto out;
-            }
+            printf("%08x %s\n", (uint32_t)stream.pos, basename(argv[argc - 1]));
+            r = 0;
+            goto out;
         }
+#endif
 
-        // Now that we have an uncompressed .elixir file, extract the files
+        // Now that we have an uncompressed .elixir stream, extract the files
         json = json_value_init_object();
         json_object_set_string(json_object(json), "name", basename(argv[argc - 1]));
         json_object_set_boolean(json_object(json), "compressed", (gz_pos != NULL));
 
         *elixir_pos = 0;
-        if (!list_only && !create_path(argv[argc - 1]))
+        if (!list_only && !check_only && !create_path(argv[argc - 1]))
             goto out;
 
-        lxr_header* hdr = (lxr_header*)buf;
-        if (hdr->magic != EARC_MAGIC) {
+        lxr_header hdr;
+        if (!lxr_read(&stream, &hdr, sizeof(hdr)))
+            goto out;
+        if (hdr.magic != EARC_MAGIC) {
             fprintf(stderr, "ERROR: Not an elixir file (bad magic)\n");
             goto out;
         }
-        if (hdr->filename_size > 0x100) {
-            fprintf(stderr, "ERROR: filename_size is too large (0x%08X)\n", hdr->filename_size);
+        if (hdr.filename_size > 0x100) {
+            fprintf(stderr, "ERROR: filename_size is too large (0x%08X)\n", hdr.filename_size);
             goto out;
         }
-        json_object_set_number(json_object(json), "filename_size", hdr->filename_size);
-        lxr_entry_size += 0x20 + (hdr->filename_size <<= 4);
-        json_object_set_number(json_object(json), "flags", hdr->flags);
+        json_object_set_number(json_object(json), "filename_size", hdr.filename_size);
+        lxr_entry_size += 0x20 + (hdr.filename_size <<= 4);
+        json_object_set_number(json_object(json), "flags", hdr.flags);
         // If we find files with different additional files or name sizes
         // the following may become important to have stored
-        json_object_set_number(json_object(json), "header_size", hdr->header_size);
-        json_object_set_number(json_object(json), "table_size", hdr->table_size);
+        json_object_set_number(json_object(json), "header_size", hdr.header_size);
+        json_object_set_number(json_object(json), "table_size", hdr.table_size);
+        json_object_set_number(json_object(json), "nb_files", hdr.nb_files);
 
-        if (sizeof(lxr_header) + (size_t)hdr->nb_files * lxr_entry_size + hdr->payload_size != file_size) {
-            fprintf(stderr, "ERROR: File size mismatch\n");
+        uint64_t data_start = sizeof(lxr_header) + (uint64_t)hdr.nb_files * lxr_entry_size;
+        uint64_t data_end = data_start + hdr.payload_size;
+        table = malloc((size_t)hdr.nb_files * lxr_entry_size);
+        sorted = calloc(max(hdr.nb_files, 1), sizeof(lxr_entry*));
+        if ((table == NULL) || (sorted == NULL)) {
+            fprintf(stderr, "ERROR: Can't allocate table\n");
             goto out;
         }
-        json_object_set_number(json_object(json), "nb_files", hdr->nb_files);
+        if (!lxr_read(&stream, table, (uint64_t)hdr.nb_files * lxr_entry_size))
+            goto out;
 
         JSON_Value* json_files_array = json_value_init_array();
+        json_object_set_value(json_object(json), "files", json_files_array);
+        uint32_t nb_sorted = 0;
         printf("OFFSET   SIZE     NAME\n");
-        for (uint32_t i = 0; i < hdr->nb_files; i++) {
-            lxr_entry* entry = (lxr_entry*)&buf[sizeof(lxr_header) + (size_t)i * lxr_entry_size];
-            assert(entry->offset + entry->size <= (uint32_t)file_size);
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            lxr_entry* entry = (lxr_entry*)&table[(size_t)i * lxr_entry_size];
+            entry->filename[0x20 + hdr.filename_size - 1] = 0;
             // Ignore "dummy" entries
             if ((entry->size == 0) && (strcmp(entry->filename, "dummy") == 0))
                 continue;
+            if ((entry->size != 0) && ((entry->offset < data_start) || ((uint64_t)entry->offset + entry->size > data_end))) {
+                fprintf(stderr, "ERROR: Data for '%s' is out of range\n", entry->filename);
+                goto out;
+            }
             json_array_append_string(json_array(json_files_array), entry->filename);
+            if (nb_patterns != 0) {
+                uint32_t p;
+                for (p = 0; (p < nb_patterns) && !match_glob(patterns[p], entry->filename); p++);
+                if (p >= nb_patterns)
+                    continue;
+            }
             snprintf(path, sizeof(path), "%s%c%s", argv[argc - 1], PATH_SEP, entry->filename);
             printf("%08x %08x %s\n", entry->offset, entry->size, path);
-            if (list_only)
+            sorted[nb_sorted++] = entry;
+        }
+        if ((nb_patterns != 0) && (nb_sorted == 0)) {
+            fprintf(stderr, "ERROR: No entry matches the pattern(s) provided\n");
+            goto out;
+        }
+        // The table is all we need for listing
+        if (list_only) {
+            r = 0;
+            goto out;
+        }
+
+        // Extract the files in the order in which their data appears in the stream
+        qsort(sorted, nb_sorted, sizeof(lxr_entry*), compare_entry_offsets);
+        for (uint32_t i = 0; i < nb_sorted; i++) {
+            lxr_entry* entry = sorted[i];
+            snprintf(path, sizeof(path), "%s%c%s", argv[argc - 1], PATH_SEP, entry->filename);
+            if (entry->size == 0) {
+                if (!check_only && !write_file(NULL, 0, path, false))
+                    goto out;
                 continue;
-            if (!write_file(&buf[entry->offset], entry->size, path, false))
+            }
+            // Entries may share data, which we then need to read again
+            if ((entry->offset < stream.pos) && !lxr_rewind(&stream))
+                goto out;
+            if (!lxr_skip(&stream, entry->offset - stream.pos))
                 goto out;
+            if (check_only ? !lxr_skip(&stream, entry->size) : !lxr_copy_to_file(&stream, entry->size, path))
+                goto out;
+        }
+        // Since skipped chunks are inflated, partial extraction stops after the last entry
+        if ((nb_patterns == 0) && (!lxr_skip(&stream, data_end - stream.pos) || !lxr_at_end(&stream))) {
+            fprintf(stderr, "ERROR: File size mismatch\n");
+            goto out;
         }
 
-        json_object_set_value(json_object(json), "files", json_files_array);
+        if (check_only) {
+            uint64_t elapsed = max(get_time_us() - start_time, 1);
+            printf("OK: %u chunk(s), %08x bytes in %.1f ms (%.1f MB/s)\n", stream.nb_read_chunks,
+                (uint32_t)stream.pos, elapsed / 1000.0, (double)stream.pos / elapsed);
+            r = 0;
+            goto out;
+        }
+
+        // Partial extraction doesn't produce a JSON, since it couldn't be used to repack
         snprintf(path, sizeof(path), "%s%celixir.json", argv[argc - 1], PATH_SEP);
-        if (!list_only)
+        if (nb_patterns == 0)
             json_serialize_to_file_pretty(json, path);
 
         r = 0;
@@ -391,14 +985,24 @@ int main_utf8(int argc, char** argv)
 
 out:
     json_value_free(json);
-    free(buf);
-    free(zbuf);
-    free(compressor);
+    lxr_close(&stream);
+    lxw_close(&writer);
+    unmap_file(&map);
+    free(table);
+    free(sorted);
+    free(patterns);
     if (file != NULL)
         fclose(file);
     if (dst != NULL)
         fclose(dst);
 
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = process_batch(argc, argv, "jxz", process_file);
+
     if (r != 0) {
         fflush(stdin);
         printf("\nPress any key to continue...");
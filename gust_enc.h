@@ -0,0 +1,88 @@
+/*
+  gust_enc_lib - Encoding/decoding library for Gust (Koei/Tecmo) .e files
+  Copyright © 2019-2020 - VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define GUST_ENC_HEADER_SIZE    0x10
+#define GUST_ENC_FOOTER_SIZE    0x10
+
+// Glaze compression levels. Level 0 doesn't look for matches, and only copies the data
+// as literal runs, which is about 0.6% larger than the original.
+#define GUST_ENC_MAX_LEVEL      9
+#define GUST_ENC_DEFAULT_LEVEL  6
+
+// The scrambling seeds of a game, as found in gust_enc.json
+typedef struct {
+    uint32_t main[3];
+    uint32_t table[3];
+    uint32_t length[3];
+    uint16_t fence;
+} gust_enc_seeds;
+
+// An encoding/decoding context, that holds all the state of the codec. The functions
+// below are reentrant, and different contexts may be used concurrently, but a single
+// context must not be used by more than one thread at a time.
+typedef struct gust_enc_ctx gust_enc_ctx;
+
+// Create a context for the seeds and scrambler version (2 or 3) of a game.
+// Returns NULL if the version is not supported or on allocation error.
+gust_enc_ctx* gust_enc_init(const gust_enc_seeds* seeds, uint32_t version);
+void gust_enc_free(gust_enc_ctx* ctx);
+
+// Set the compression effort, from 0 to GUST_ENC_MAX_LEVEL, for the next encoded buffers
+void gust_enc_set_level(gust_enc_ctx* ctx, int level);
+
+// Check that all the seeds are prime numbers, as they should be
+bool gust_enc_check_seeds(const gust_enc_seeds* seeds);
+
+// Compress and scramble a buffer into a newly allocated .e buffer, that the caller must
+// free. Returns the size of the .e data, or 0 on error.
+uint32_t gust_enc_encode(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst);
+
+// Descramble and uncompress .e data into a newly allocated buffer, that the caller must
+// free. Returns the size of the decoded data, or 0 on error.
+uint32_t gust_enc_decode(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst);
+
+// Return the working size recorded in the header of .e data, which is the size of the
+// buffer the game allocates to decode it, or 0 if the header is invalid.
+uint32_t gust_enc_get_working_size(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size);
+
+// Lower level functions, to process the scrambling and Glaze compression layers separately.
+// Glaze data uses the byte order of the last scrambled or descrambled buffer.
+
+// Scramble a Glaze compressed payload into a newly allocated .e buffer. Returns its size.
+uint32_t gust_enc_scramble(gust_enc_ctx* ctx, const uint8_t* payload, uint32_t payload_size,
+                           uint32_t working_size, uint8_t** dst);
+// Descramble .e data in place, with the payload starting at &buf[GUST_ENC_HEADER_SIZE].
+// Returns the size of the payload, or 0 on error.
+uint32_t gust_enc_unscramble(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size, uint32_t* working_size);
+// Compress a buffer into a newly allocated Glaze buffer. Returns its size.
+uint32_t gust_enc_glaze(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst);
+// Uncompress a Glaze buffer. Returns the size of the uncompressed data, or 0 on error.
+uint32_t gust_enc_unglaze(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size,
+                          uint8_t* dst, uint32_t dst_size);
+
+#if defined(__cplusplus)
+}
+#endif
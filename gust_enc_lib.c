@@ -0,0 +1,1227 @@
+/*
+  gust_enc_lib - Encoding/decoding library for Gust (Koei/Tecmo) .e files
+  Copyright © 2019-2020 - VitaSmith
+  Prime number computation copyright © 2001-2003 - Stephane Carrez
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "util.h"
+#include "gust_enc.h"
+
+#define E_HEADER_SIZE       GUST_ENC_HEADER_SIZE
+#define E_FOOTER_SIZE       GUST_ENC_FOOTER_SIZE
+
+// Both of these are prime numbers
+#define RANDOM_CONSTANT     0x3b9a73c9
+#define RANDOM_INCREMENT    0x2f09
+#define MB                  (1024 * 1024)
+
+// For Sophie's GrowData.xml.e
+//#define VALIDATE_CHECKSUM   0x52ccbbab
+// For Sophie's Marquee.xml.e
+//#define VALIDATE_CHECKSUM   0x92ca8716
+
+//#define USE_GLAZED
+
+// Compiled scrambling table: swap bit b0 of byte p0 with bit b1 of byte p1
+typedef struct {
+    uint8_t p0, b0, p1, b1;
+} bit_swap;
+
+#define SCRAMBLING_CACHE_SIZE   16
+
+typedef struct {
+    uint32_t seed[2];
+    uint32_t next_seed;
+    uint32_t table_size;
+    uint32_t max_table_size;
+    bit_swap* swaps;
+} scrambling_cache_entry;
+
+struct gust_enc_ctx {
+    gust_enc_seeds seeds;
+    uint32_t version;
+    int level;
+    uint32_t random_seed[2];
+    bool big_endian;
+    // Scratch memory for the scrambling tables, reset after each call
+    arena scratch;
+    scrambling_cache_entry scrambling_cache[SCRAMBLING_CACHE_SIZE];
+    uint32_t scrambling_cache_next;
+};
+
+#define getdata16(ctx, x) ((ctx)->big_endian ? getbe16(x) : getle16(x))
+#define getdata32(ctx, x) ((ctx)->big_endian ? getbe32(x) : getle32(x))
+#define setdata16(ctx, x, v) ((ctx)->big_endian ? setbe16(x, v): setle16(x, v))
+#define setdata32(ctx, x, v) ((ctx)->big_endian ? setbe32(x, v): setle32(x, v))
+
+/*
+ * Helper functions to generate predictible semirandom numbers
+ */
+static __inline void init_random(gust_enc_ctx* ctx, uint32_t r0, uint32_t r1)
+{
+    ctx->random_seed[0] = RANDOM_CONSTANT + r0;
+    ctx->random_seed[1] = r1;
+}
+
+static __inline uint16_t get_random_u15(gust_enc_ctx* ctx)
+{
+    ctx->random_seed[1] = ctx->random_seed[0] * ctx->random_seed[1] + RANDOM_INCREMENT;
+    return (ctx->random_seed[1] >> 16) & 0x7fff;
+}
+
+static __inline uint16_t get_random_u16(gust_enc_ctx* ctx)
+{
+    ctx->random_seed[1] = ctx->random_seed[0] * ctx->random_seed[1] + RANDOM_INCREMENT;
+    return ctx->random_seed[1] >> 16;
+}
+
+/*
+ * Stupid sexy scramblers ("Feels like I'm reading nothing at all!")
+ *
+ * All the scramblers below are seeded scramblers that derive values from the formula
+ * seed[1] = seed[0] * seed[1] + 0x2f09, with seed[0] being prime number 0x3b9a73c9
+ * (or a variation thereof) and seed[1] another 16-bit prime number.
+ *
+ * From there, they only differ in the manner with which they use the updated seed.
+ */
+
+// A scrambling table is a permutation of [0, table_size), where each value is picked
+// among the ones that haven't been used yet, using the next semi-random number. The
+// consecutive pairs of values from that table are the positions (byte << 3 | bit) of
+// the bits to swap, which we precompile into a swap program. Since that program only
+// depends on the seeds and size, and since the end of v2 files is always scrambled
+// from the same seeds, programs are cached, along with the resulting seed.
+static void free_scrambling_cache(gust_enc_ctx* ctx)
+{
+    for (uint32_t i = 0; i < SCRAMBLING_CACHE_SIZE; i++)
+        free(ctx->scrambling_cache[i].swaps);
+    memset(ctx->scrambling_cache, 0, sizeof(ctx->scrambling_cache));
+}
+
+// Return the table_size / 2 bit swaps for the current seeds
+static const bit_swap* get_swap_program(gust_enc_ctx* ctx, uint32_t table_size)
+{
+    scrambling_cache_entry* e;
+    for (uint32_t i = 0; i < SCRAMBLING_CACHE_SIZE; i++) {
+        e = &ctx->scrambling_cache[i];
+        if ((e->swaps != NULL) && (e->table_size == table_size) &&
+            (e->seed[0] == ctx->random_seed[0]) && (e->seed[1] == ctx->random_seed[1])) {
+            ctx->random_seed[1] = e->next_seed;
+            return e->swaps;
+        }
+    }
+
+    e = &ctx->scrambling_cache[ctx->scrambling_cache_next++ % SCRAMBLING_CACHE_SIZE];
+    if (e->max_table_size < table_size) {
+        free(e->swaps);
+        e->swaps = malloc((size_t)(table_size / 2) * sizeof(bit_swap));
+        e->max_table_size = (e->swaps == NULL) ? 0 : table_size;
+    }
+    // Tables are at most 0x800 entries, for which shifting the array of unused values
+    // after each pick is faster than maintaining an order statistic tree.
+    arena_pos pos = arena_save(&ctx->scratch);
+    uint16_t* base_table = arena_alloc(&ctx->scratch, (size_t)table_size * sizeof(uint16_t));
+    uint16_t* scrambling_table = arena_alloc(&ctx->scratch, (size_t)table_size * sizeof(uint16_t));
+    if ((e->swaps == NULL) || (base_table == NULL) || (scrambling_table == NULL)) {
+        arena_restore(&ctx->scratch, pos);
+        e->table_size = 0;
+        return NULL;
+    }
+    e->seed[0] = ctx->random_seed[0];
+    e->seed[1] = ctx->random_seed[1];
+    // Create a base table of incremental 16-bit values
+    for (uint32_t i = 0; i < table_size; i++)
+        base_table[i] = (uint16_t)i;
+    // Now create a scrambled table from the above
+    for (uint32_t i = 0; i < table_size; i++) {
+        // Translate this semi-random value to a base_table index we haven't used yet
+        uint32_t x = get_random_u15(ctx) % (table_size - i);
+        scrambling_table[i] = base_table[x];
+        // Now remove the value we used from base_table
+        memmove(&base_table[x], &base_table[x + 1], (size_t)(table_size - i - x - 1) * sizeof(uint16_t));
+    }
+    // Byte positions are 8-bit, which matches the maximum slice size we use
+    for (uint32_t i = 0; i < table_size / 2; i++) {
+        e->swaps[i].p0 = (uint8_t)(scrambling_table[2 * i] >> 3);
+        e->swaps[i].b0 = (uint8_t)(scrambling_table[2 * i] & 7);
+        e->swaps[i].p1 = (uint8_t)(scrambling_table[2 * i + 1] >> 3);
+        e->swaps[i].b1 = (uint8_t)(scrambling_table[2 * i + 1] & 7);
+    }
+    arena_restore(&ctx->scratch, pos);
+    e->next_seed = ctx->random_seed[1];
+    e->table_size = table_size;
+    return e->swaps;
+}
+
+// Scramble individual bits between two semi-random bit positions within a slice.
+static bool bit_scrambler(gust_enc_ctx* ctx, uint8_t* chunk, uint32_t chunk_size, uint32_t slice_size,
+                          bool descramble)
+{
+    // Table_size needs to be 8 * slice_size, to encompass all individual bit positions.
+    // The swap program stores byte positions on 8 bits, so slices can't be larger than 0x100.
+    uint32_t table_size = slice_size << 3;
+    if ((table_size < 4) || (table_size > 0x800))
+        return false;
+
+    uint8_t* max_chunk = &chunk[chunk_size];
+    while (chunk < max_chunk) {
+        // Make sure we don't overflow our table, else we're going to pick
+        // bits located outside our chunk
+        table_size = min(table_size, chunk_size << 3);
+        const bit_swap* swaps = get_swap_program(ctx, table_size);
+        if (swaps == NULL)
+            return false;
+
+        // The scrambler swaps the bits at position p0.b0 and p1.b1, which we do without
+        // branching, by flipping both bits when they differ. To perform the reverse
+        // operation, the swaps must be applied in the reverse order since sequential
+        // bit swaps are not commutative.
+        int32_t nb_swaps = (int32_t)(table_size / 2);
+        int32_t start_value = descramble ? 0 : nb_swaps - 1;
+        int32_t increment = descramble ? +1 : -1;
+        for (int32_t i = start_value; (i >= 0) && (i < nb_swaps); i += increment) {
+            const bit_swap s = swaps[i];
+            uint8_t t = ((chunk[s.p0] >> s.b0) ^ (chunk[s.p1] >> s.b1)) & 1;
+            chunk[s.p0] ^= t << s.b0;
+            chunk[s.p1] ^= t << s.b1;
+        }
+
+        chunk = &chunk[slice_size];
+        chunk_size -= slice_size;
+    }
+
+    return true;
+}
+
+// Sequentially scramble bytes by adding the updated seed and, depending on whether
+// the modulo with the current seed falls above or below a "fence", XORing the seed.
+static bool fenced_scrambler(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size, uint16_t fence,
+                             bool descramble, bool extra_fudge)
+{
+    for (uint32_t i = 0; i < buf_size; i += 2) {
+        uint16_t x = get_random_u15(ctx);
+        uint16_t w = getdata16(ctx, &buf[i]);
+        // The fence is a 12-bit prime number
+        if (descramble) {
+            if (x % (fence * 2) >= fence)
+                w ^= extra_fudge ? get_random_u15(ctx) : x;
+            w -= x;
+        } else {
+            w += x;
+            if (x % (fence * 2) >= fence)
+                w ^= extra_fudge ? get_random_u15(ctx) : x;
+        }
+        setdata16(ctx, &buf[i], w);
+    }
+    return true;
+}
+
+// Sequentially scramble bytes by XORing them with a set of 3 rotated seeds.
+static bool rotating_scrambler(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size, const gust_enc_seeds* seeds)
+{
+    // We're updating seed values in the table, so make sure we work on a copy
+    uint32_t seed_table[3] = { seeds->table[0], seeds->table[1], seeds->table[2] };
+    uint32_t seed_index = 0;
+    uint32_t seed_switch_fudge = 0;
+    uint32_t processed_for_this_seed = 0;
+    for (uint32_t i = 0; i < buf_size; i++) {
+        buf[i] ^= get_random_u16(ctx);
+        if (++processed_for_this_seed >= seeds->length[seed_index] + seed_switch_fudge) {
+            seed_table[seed_index++] = ctx->random_seed[1];
+            if (seed_index >= array_size(seed_table)) {
+                seed_index = 0;
+                seed_switch_fudge++;
+            }
+            ctx->random_seed[1] = seed_table[seed_index];
+            processed_for_this_seed = 0;
+        }
+    }
+    return true;
+}
+
+/*
+  The following functions deal with the compression algorithm used by Gust, which
+  looks like a derivative of LZSS that I am calling 'Glaze', for "Gust Lempel–Ziv".
+ */
+typedef struct {
+    const uint8_t* buffer;
+    uint32_t size;
+    uint32_t pos;
+    int getbits_buffer;
+    int getbits_mask;
+} getbits_ctx;
+
+#define GETBITS_EOF 0xffffffff
+static uint32_t getbits(getbits_ctx* ctx, int n)
+{
+    int x = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (ctx->getbits_mask == 0x00) {
+            if (ctx->pos >= ctx->size)
+                return GETBITS_EOF;
+            ctx->getbits_buffer = ctx->buffer[ctx->pos++];
+            ctx->getbits_mask = 0x80;
+        }
+        x <<= 1;
+        if (ctx->getbits_buffer & ctx->getbits_mask)
+            x++;
+        ctx->getbits_mask >>= 1;
+    }
+
+    return x;
+}
+
+// Boy with extended open hand, looking at butterfly: "Is this Huffman encoding?"
+static uint8_t* build_code_table(gust_enc_ctx* ctx, const uint8_t* bitstream, uint32_t bitstream_length)
+{
+    uint32_t code_table_length = getdata32(ctx, bitstream);
+    if (code_table_length > 256 * MB) {
+        fprintf(stderr, "ERROR: Glaze code table length is too large\n");
+        return NULL;
+    }
+    uint8_t* code_table = malloc(code_table_length);
+    if (code_table == NULL)
+        return NULL;
+    getbits_ctx bits = { 0 };
+    bits.buffer = &bitstream[sizeof(uint32_t)];
+    bits.size = bitstream_length - sizeof(uint32_t);
+
+    for (uint32_t c = getbits(&bits, 1), i = 0; i < code_table_length; c = getbits(&bits, 1), i++) {
+        if (c == GETBITS_EOF) {
+            break;
+        } else if (c == 1) {
+            // Bit sequence starts with 1 -> emit code 0x01
+            code_table[i] = 1;
+        } else {
+            // Bit sequence starts with 0 -> get the length of code and emit it
+            int code_len = 0;
+            while ((++code_len < 8) && ((c = getbits(&bits, 1)) == 0));
+            if (c == GETBITS_EOF)
+                break;
+            if (code_len < 8)
+                code_table[i] = (uint8_t)((c << code_len) | getbits(&bits, code_len));
+            else
+                code_table[i] = 0;
+        }
+    }
+
+    return code_table;
+}
+
+// Uncompress a glaze compressed buffer
+uint32_t gust_enc_unglaze(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_length,
+                          uint8_t* dst, uint32_t dst_length)
+{
+    uint32_t dec_length = getdata32(ctx, src);
+    src = &src[sizeof(uint32_t)];
+    if (dec_length > dst_length) {
+        fprintf(stderr, "ERROR: Glaze decompression buffer is too small\n");
+        return 0;
+    }
+
+    uint32_t bitstream_length = getdata32(ctx, src);
+    src = &src[sizeof(uint32_t)];
+    if (bitstream_length <= sizeof(uint32_t)) {
+        fprintf(stderr, "ERROR: Glaze decompression bitstream is too small\n");
+        return 0;
+    }
+
+    uint32_t chk_length = bitstream_length + sizeof(uint32_t);
+    if (chk_length >= src_length) {
+        fprintf(stderr, "ERROR: Glaze decompression bitstream is too large\n");
+        return 0;
+    }
+
+    uint32_t code_len = getdata32(ctx, src);
+    uint8_t* code_table = build_code_table(ctx, src, bitstream_length);
+    if (code_table == NULL)
+        return 0;
+
+    const uint8_t* dict = &src[bitstream_length];
+    uint32_t dict_len = getdata32(ctx, dict);
+    dict = &dict[sizeof(uint32_t)];
+    chk_length += dict_len + sizeof(uint32_t);
+    if (chk_length >= src_length) {
+        fprintf(stderr, "ERROR: Glaze decompression dictionary is too large\n");
+        free(code_table);
+        return 0;
+    }
+
+    const uint8_t* len = &dict[dict_len];
+    const uint8_t* max_dict = len;
+    uint32_t len_len = getdata32(ctx, len);
+    len = &len[sizeof(uint32_t)];
+    const uint8_t* max_len = &len[len_len];
+    chk_length += len_len + sizeof(uint32_t);
+    if (chk_length >= src_length) {
+        fprintf(stderr, "ERROR: Glaze decompression length table is too large\n");
+        free(code_table);
+        return 0;
+    }
+
+    int l, d;
+    uint8_t* dst_max = &dst[dec_length];
+    uint8_t* code = code_table;
+    uint8_t* max_code = &code_table[code_len];
+    while (dst < dst_max) {
+        // Sanity checks
+        if ((dict > max_dict) || (len > max_len) || (code > max_code)) {
+            fprintf(stderr, "ERROR: Glaze decompression overflow\n");
+            free(code_table);
+            return 0;
+        }
+        switch (*code++) {
+        case 0x01:  // 1-byte code
+            // Copy one byte
+            *dst++ = *dict++;
+            break;
+        case 0x02:  // 2-byte code
+            // Duplicate one byte from pos -d where d is provided by the code table
+            d = *code++;
+            *dst++ = dst[-d];
+            break;
+        case 0x03:  // 3-byte code
+            // Duplicate l bytes from position -(d + l) where both d and l are provided by the code table
+            d = *code++;
+            l = *code++;
+            d += l;
+            for (int i = ++l; i > 0; i--)
+                *dst++ = dst[-d];
+            break;
+        case 0x04:  // 2-byte code
+            // Duplicate l bytes from position -(d + l) where l is provided by the code table and d by the source
+            l = *code++;
+            d = *dict++ + l;
+            for (int i = ++l; i > 0; i--)
+                *dst++ = dst[-d];
+            break;
+        case 0x05:  // 3-byte code
+            // Same as above except with a 16-bit distance where the MSB is provided by the code table and LSB by the source
+            d = *code++ << 8 | *dict++;
+            l = *code++;
+            d += l;
+            for (int i = ++l; i > 0; i--)
+                *dst++ = dst[-d];
+            break;
+        case 0x06:  // 2-byte code
+            // Copy l + 8 bytes from source where l is provided by the code table
+            l = *code++ + 8;
+            for (int i = l; i > 0; i--) {
+                *dst++ = *dict++;
+                if (dst > dst_max) {
+                    fprintf(stderr, "WARNING: Dictionary overflow for bytecode 0x06 (%d bytes)\n", i);
+                    break;
+                }
+            }
+            break;
+        case 0x07:  // 1-byte code + 1 byte from length table
+            // Copy l + 14 bytes from the source where l is provided by the (separate) length table
+            for (int i = *len++ + 14; i > 0; i--) {
+                *dst++ = *dict++;
+                if (dst > dst_max) {
+                    fprintf(stderr, "WARNING: Dictionary overflow for bytecode 0x07 (%d bytes)\n", i);
+                    break;
+                }
+            }
+            break;
+        }
+    }
+
+    free(code_table);
+    return dec_length;
+}
+
+/*
+ * Glaze compression: Each byte of the code table is a prefix code, where 0x00 is
+ * 8 zero bits, and any other value v of n significant bits is written over 2n-1 bits
+ * (i.e. with n-1 leading zeros). The bytecodes, with their parameters, are:
+ * - 0x01:        copy 1 byte from the dictionary
+ * - 0x02 D:      copy 1 byte from distance D
+ * - 0x03 d l:    copy l+1 bytes from distance d+l
+ * - 0x04 l:      copy l+1 bytes from distance d+l, with d read from the dictionary
+ * - 0x05 dh l:   same as above, with a 16-bit d whose LSB is read from the dictionary
+ * - 0x06 l:      copy l+8 bytes from the dictionary
+ * - 0x07:        copy l+14 bytes from the dictionary, with l read from the length table
+ * We find matches using hash chains over the last 64 KB, and pick the bytecodes that
+ * use the least bits. The effort level sets how many candidates we check for each
+ * position, and whether we also look for a better match at the next one.
+ */
+#define GLAZE_HASH_BITS     16
+#define GLAZE_WINDOW_SIZE   (1 << 17)
+#define GLAZE_MIN_MATCH     3
+#define GLAZE_MAX_MATCH     256
+#define GLAZE_MAX_DISTANCE  (0xffff + GLAZE_MAX_MATCH - 1)
+#define GLAZE_NO_POS        0xffffffff
+#define GLAZE_LITERAL_BITS  8
+// Interrupting a run of literals costs about this many bits in extra bytecodes
+#define GLAZE_RUN_BREAK     6
+
+typedef struct {
+    uint32_t max_chain;     // Maximum number of hash chain candidates to check
+    uint32_t nice_length;   // Stop looking for a longer match past this length
+    bool lazy;              // Check if the next position has a better match
+} glaze_level;
+
+static const glaze_level glaze_levels[GUST_ENC_MAX_LEVEL + 1] = {
+    { 0, 0, false },        // No match search, only literal runs
+    { 1, 16, false },
+    { 4, 32, false },
+    { 8, 64, false },
+    { 16, 64, true },
+    { 32, 128, true },
+    { 64, 256, true },
+    { 256, 256, true },
+    { 1024, 256, true },
+    { 4096, 256, true },
+};
+
+typedef struct {
+    uint8_t* codes;
+    uint32_t nb_codes;
+    uint8_t* dict;
+    uint32_t dict_size;
+    uint8_t* lengths;
+    uint32_t nb_lengths;
+    uint64_t nb_bits;
+} glaze_stream;
+
+typedef struct {
+    uint32_t distance;
+    uint32_t length;
+    int32_t score;
+} glaze_match;
+
+// Number of bits used to encode value v in the code table
+static __inline uint32_t glaze_code_bits(uint32_t v)
+{
+    uint32_t n = 0;
+    if (v == 0)
+        return 8;
+    while (v >>= 1)
+        n++;
+    return 2 * n + 1;
+}
+
+static __inline void glaze_add_code(glaze_stream* s, uint8_t v)
+{
+    s->codes[s->nb_codes++] = v;
+    s->nb_bits += glaze_code_bits(v);
+}
+
+// Return the number of bits used to encode a match, along with its dictionary byte if any
+static uint32_t glaze_match_bits(uint32_t distance, uint32_t length, uint8_t* opcode)
+{
+    if (length == 1) {
+        *opcode = 0x02;
+        return (distance <= 0xff) ? 3 + glaze_code_bits(distance) : 0xffff;
+    }
+    uint32_t l = length - 1, d = distance - l;
+    uint32_t l_bits = glaze_code_bits(l);
+    if (d <= 0xff) {
+        uint32_t bits = 3 + glaze_code_bits(d) + l_bits;
+        *opcode = 0x03;
+        if (5 + 8 + l_bits < bits) {
+            *opcode = 0x04;
+            bits = 5 + 8 + l_bits;
+        }
+        return bits;
+    }
+    *opcode = 0x05;
+    return (d <= 0xffff) ? 5 + glaze_code_bits(d >> 8) + 8 + l_bits : 0xffff;
+}
+
+static __inline int32_t glaze_match_score(uint32_t distance, uint32_t length)
+{
+    uint8_t opcode;
+    return (int32_t)(length * GLAZE_LITERAL_BITS) - (int32_t)glaze_match_bits(distance, length, &opcode);
+}
+
+static void glaze_add_match(glaze_stream* s, uint32_t distance, uint32_t length)
+{
+    uint8_t opcode;
+    uint32_t l = length - 1, d = distance - l;
+    glaze_match_bits(distance, length, &opcode);
+    glaze_add_code(s, opcode);
+    switch (opcode) {
+    case 0x02:
+        glaze_add_code(s, (uint8_t)distance);
+        break;
+    case 0x03:
+        glaze_add_code(s, (uint8_t)d);
+        glaze_add_code(s, (uint8_t)l);
+        break;
+    case 0x04:
+        glaze_add_code(s, (uint8_t)l);
+        s->dict[s->dict_size++] = (uint8_t)d;
+        s->nb_bits += 8;
+        break;
+    case 0x05:
+        glaze_add_code(s, (uint8_t)(d >> 8));
+        s->dict[s->dict_size++] = (uint8_t)d;
+        s->nb_bits += 8;
+        glaze_add_code(s, (uint8_t)l);
+        break;
+    }
+}
+
+static void glaze_add_literals(glaze_stream* s, const uint8_t* src, uint32_t size)
+{
+    memcpy(&s->dict[s->dict_size], src, size);
+    s->dict_size += size;
+    s->nb_bits += (uint64_t)size * 8;
+    while (size > 0) {
+        // 0x01 costs 1 bit per byte, 0x06 5 bits plus its length, and 0x07 5 bits plus
+        // 8 bits in the length table, which is the cheapest from 24 bytes onwards.
+        uint32_t n;
+        if (size >= 24) {
+            n = min(size, 255 + 14);
+            glaze_add_code(s, 0x07);
+            s->lengths[s->nb_lengths++] = (uint8_t)(n - 14);
+            s->nb_bits += 8;
+        } else if (size >= 9) {
+            n = size;
+            glaze_add_code(s, 0x06);
+            glaze_add_code(s, (uint8_t)(n - 8));
+        } else {
+            n = 1;
+            glaze_add_code(s, 0x01);
+        }
+        size -= n;
+    }
+}
+
+static __inline uint32_t glaze_hash(const uint8_t* p)
+{
+    return ((uint32_t)(p[0] << 16 | p[1] << 8 | p[2]) * 0x9e3779b1) >> (32 - GLAZE_HASH_BITS);
+}
+
+// Find the match with the best score for position pos, or a zero score if there is none
+static glaze_match glaze_find_match(const uint8_t* src, uint32_t src_size, uint32_t pos,
+                                    const uint32_t* head, const uint32_t* prev,
+                                    const glaze_level* level)
+{
+    glaze_match best = { 0, 0, 0 };
+    uint32_t max_length = min(GLAZE_MAX_MATCH, src_size - pos);
+
+    // Very short matches only pay off for nearby data, which the hash chains skip
+    for (uint32_t distance = 1; (distance <= 4) && (distance <= pos); distance++) {
+        uint32_t length = 0;
+        while ((length < min(max_length, 2)) && (src[pos + length] == src[pos + length - distance]))
+            length++;
+        if ((length > 0) && (glaze_match_score(distance, length) > best.score)) {
+            best.distance = distance;
+            best.length = length;
+            best.score = glaze_match_score(distance, length);
+        }
+    }
+    if (max_length < GLAZE_MIN_MATCH)
+        return best;
+
+    uint32_t candidate = head[glaze_hash(&src[pos])];
+    for (uint32_t chain = 0; (chain < level->max_chain) && (candidate < pos); chain++) {
+        uint32_t distance = pos - candidate;
+        if (distance > GLAZE_MAX_DISTANCE)
+            break;
+        // A match can't be longer than its distance + 1
+        uint32_t limit = min(max_length, distance + 1);
+        if ((best.length < limit) && (src[candidate + best.length] == src[pos + best.length])) {
+            uint32_t length = 0;
+            while ((length < limit) && (src[candidate + length] == src[pos + length]))
+                length++;
+            if (length >= GLAZE_MIN_MATCH) {
+                int32_t score = glaze_match_score(distance, length);
+                if (score > best.score) {
+                    best.distance = distance;
+                    best.length = length;
+                    best.score = score;
+                    if (length >= level->nice_length)
+                        break;
+                }
+            }
+        }
+        uint32_t next = prev[candidate % GLAZE_WINDOW_SIZE];
+        if (next >= candidate)
+            break;
+        candidate = next;
+    }
+    return best;
+}
+
+// Compress a payload
+uint32_t gust_enc_glaze(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst)
+{
+    uint32_t r = 0;
+    glaze_stream s = { 0 };
+    const glaze_level* level = &glaze_levels[ctx->level];
+    arena_pos arena_start = arena_save(&ctx->scratch);
+
+    *dst = NULL;
+    // Every bytecode produces at least one byte, and uses at most 2 codes for each
+    s.codes = malloc((size_t)src_size * 2 + 1);
+    s.dict = malloc((size_t)src_size + 1);
+    s.lengths = malloc((size_t)src_size / 14 + 1);
+    uint32_t* head = arena_alloc(&ctx->scratch, (size_t)(1 << GLAZE_HASH_BITS) * sizeof(uint32_t));
+    uint32_t* prev = arena_alloc(&ctx->scratch, (size_t)GLAZE_WINDOW_SIZE * sizeof(uint32_t));
+    if ((s.codes == NULL) || (s.dict == NULL) || (s.lengths == NULL) || (head == NULL) || (prev == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate Glaze compression buffers\n");
+        goto out;
+    }
+    memset(head, 0xff, (size_t)(1 << GLAZE_HASH_BITS) * sizeof(uint32_t));
+
+    uint32_t pos = 0, literal_start = 0, inserted = 0;
+    glaze_match match = { 0, 0, 0 };
+    bool have_match = false;
+    while ((level->max_chain != 0) && (pos < src_size)) {
+        // Add all the positions we went through to the hash chains
+        for (; (inserted < pos) && (inserted + GLAZE_MIN_MATCH <= src_size); inserted++) {
+            uint32_t h = glaze_hash(&src[inserted]);
+            prev[inserted % GLAZE_WINDOW_SIZE] = head[h];
+            head[h] = inserted;
+        }
+        inserted = max(inserted, pos);
+        if (!have_match)
+            match = glaze_find_match(src, src_size, pos, head, prev, level);
+        have_match = false;
+        if (match.score < ((pos > literal_start) ? GLAZE_RUN_BREAK : 1)) {
+            pos++;
+            continue;
+        }
+        if (level->lazy && (match.length < level->nice_length) && (pos + 1 < src_size)) {
+            uint32_t h = glaze_hash(&src[pos]);
+            if (pos + GLAZE_MIN_MATCH <= src_size) {
+                prev[pos % GLAZE_WINDOW_SIZE] = head[h];
+                head[h] = pos;
+                inserted = pos + 1;
+            }
+            glaze_match next = glaze_find_match(src, src_size, pos + 1, head, prev, level);
+            // Deferring the match costs us a literal
+            if (next.score > match.score + GLAZE_LITERAL_BITS) {
+                match = next;
+                have_match = true;
+                pos++;
+                continue;
+            }
+        }
+        glaze_add_literals(&s, &src[literal_start], pos - literal_start);
+        glaze_add_match(&s, match.distance, match.length);
+        pos += match.length;
+        literal_start = pos;
+    }
+    glaze_add_literals(&s, &src[literal_start], src_size - literal_start);
+
+    // A Glaze compressed file is structured as follows:
+    // [decompressed_size] [bistream_size] [bytecode_size] <...bitstream...>
+    // [dictionary_size] <...dictionary...> [length_table_size] <...length_table...>
+    uint64_t code_bits = s.nb_bits - (uint64_t)(s.dict_size + s.nb_lengths) * 8;
+    uint32_t bitstream_size = (uint32_t)((code_bits + 7) / 8);
+    uint32_t compressed_size = 3 * sizeof(uint32_t) + bitstream_size + sizeof(uint32_t) +
+        s.dict_size + sizeof(uint32_t) + s.nb_lengths;
+    *dst = calloc(compressed_size, 1);
+    if (*dst == NULL)
+        goto out;
+    uint8_t* p = *dst;
+    setdata32(ctx, p, src_size);
+    p = &p[sizeof(uint32_t)];
+    // The bitstream size includes the bytecode size field
+    setdata32(ctx, p, bitstream_size + sizeof(uint32_t));
+    p = &p[sizeof(uint32_t)];
+    setdata32(ctx, p, s.nb_codes);
+    p = &p[sizeof(uint32_t)];
+    uint32_t bit_pos = 0;
+    for (uint32_t i = 0; i < s.nb_codes; i++) {
+        uint32_t v = s.codes[i], nb_bits = glaze_code_bits(v);
+        // The value is written MSB first, with the leading zero bits being implicit
+        for (uint32_t j = nb_bits; j > 0; j--, bit_pos++) {
+            if ((v >> (j - 1)) & 1)
+                p[bit_pos / 8] |= 0x80 >> (bit_pos % 8);
+        }
+    }
+    p = &p[bitstream_size];
+    setdata32(ctx, p, s.dict_size);
+    p = &p[sizeof(uint32_t)];
+    memcpy(p, s.dict, s.dict_size);
+    p = &p[s.dict_size];
+    setdata32(ctx, p, s.nb_lengths);
+    p = &p[sizeof(uint32_t)];
+    memcpy(p, s.lengths, s.nb_lengths);
+    r = compressed_size;
+
+out:
+    free(s.codes);
+    free(s.dict);
+    free(s.lengths);
+    arena_restore(&ctx->scratch, arena_start);
+    return r;
+}
+
+void gust_enc_set_level(gust_enc_ctx* ctx, int level)
+{
+    ctx->level = max(min(level, GUST_ENC_MAX_LEVEL), 0);
+}
+
+/*
+ * Checksum algorithms
+ */
+static uint32_t checksum_sub(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size)
+{
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+        checksum -= getdata32(ctx, &buf[i]);
+    return checksum;
+}
+
+static uint32_t checksum_xor(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size)
+{
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
+        checksum ^= ~getdata32(ctx, &buf[i]);
+    return checksum;
+}
+
+uint32_t gust_enc_scramble(gust_enc_ctx* ctx, const uint8_t* payload, uint32_t payload_size,
+                           uint32_t working_size, uint8_t** dst)
+{
+    uint32_t r = 0;
+    uint32_t adler_sum, checksum[3] = { 0, 0, 0 };
+    const gust_enc_seeds* seeds = &ctx->seeds;
+    const uint32_t version = ctx->version;
+
+    ctx->big_endian = (version != 3);
+    // Align the size (plus an extra byte for the end marker) to 16-bytes
+    uint32_t main_payload_size = (payload_size + 1 + 0xf) & ~0xf;
+    uint8_t* buf = calloc((size_t)main_payload_size + E_HEADER_SIZE + E_FOOTER_SIZE, 1);
+    if (buf == NULL)
+        return 0;
+    uint8_t* main_payload = &buf[E_HEADER_SIZE];
+    memcpy(main_payload, payload, payload_size);
+    adler_sum = adler32(1, payload, payload_size);
+
+    // Optionally scramble the beginning of the file
+    if (version == 2) {
+        init_random(ctx, adler_sum, seeds->main[2]);
+        if (!bit_scrambler(ctx, main_payload, min(payload_size, 0x800), 0x80, false))
+            goto out;
+    }
+
+    // Compute the checksums
+    checksum[0] = checksum_sub(ctx, main_payload, payload_size);
+    checksum[1] = checksum_xor(ctx, main_payload, payload_size);
+    switch (version) {
+    case 2:
+#if !defined(VALIDATE_CHECKSUM)
+        checksum[2] = adler_sum;
+#else
+        checksum[2] = VALIDATE_CHECKSUM;
+#endif
+        break;
+    case 3:
+        checksum[2] = seeds->main[0];
+        break;
+    default:
+        goto out;
+    }
+
+    // Write the checksums
+    setdata32(ctx, &main_payload[(size_t)main_payload_size + 4], checksum[0]);
+    setdata32(ctx, &main_payload[(size_t)main_payload_size + 8], checksum[1]);
+    setdata32(ctx, &main_payload[(size_t)main_payload_size + 12], checksum[2]);
+
+    // Call the main scrambler
+    init_random(ctx, checksum[2], seeds->table[0]);
+    if (!rotating_scrambler(ctx, main_payload, payload_size, seeds))
+        goto out;
+
+    // Add the end of payload marker
+    main_payload[payload_size] = 0xff;
+
+    // From now on, we'll scramble the footer as well
+    main_payload_size += E_FOOTER_SIZE;
+
+    // Call first scrambler
+    init_random(ctx, 0, seeds->main[1]);
+    if (!fenced_scrambler(ctx, main_payload, main_payload_size, seeds->fence, false, (version == 3)))
+        goto out;
+
+    // Apply optional extra scrambling to the end of the file
+    if (version == 2) {
+        init_random(ctx, 0, seeds->main[0]);
+        uint8_t* chunk = &main_payload[main_payload_size - min(main_payload_size, 0x800)];
+        if (!bit_scrambler(ctx, chunk, min(main_payload_size, 0x800), 0x100, false))
+            goto out;
+    }
+
+    // Populate the header data
+    setdata32(ctx, buf, version);
+    setdata32(ctx, &buf[4], working_size);
+
+    *dst = buf;
+    buf = NULL;
+    r = main_payload_size + E_HEADER_SIZE;
+
+out:
+    free(buf);
+    arena_reset(&ctx->scratch);
+    return r;
+}
+
+// Check the header of .e data, and set the byte order and working size accordingly
+static uint32_t check_header(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size,
+                             uint32_t* working_size)
+{
+    if (((src_size % 4) != 0) || (src_size <= E_HEADER_SIZE + E_FOOTER_SIZE)) {
+        fprintf(stderr, "ERROR: Invalid file size\n");
+        return 0;
+    }
+    ctx->big_endian = (ctx->version != 3);
+    uint32_t version = getbe32(src);
+    if (version == 0x03000000) {
+        version = 3;
+        ctx->big_endian = false;
+    }
+    if ((version != 2) && (version != 3)) {
+        fprintf(stderr, "ERROR: Unsupported encoding version: 0x%08x\n", version);
+        return 0;
+    }
+    *working_size = getdata32(ctx, &src[4]);
+    if ((*working_size == 0) || (*working_size > 256 * MB)) {
+        fprintf(stderr, "ERROR: Unexpected working size: 0x%08x\n", *working_size);
+        return 0;
+    }
+    return version;
+}
+
+uint32_t gust_enc_get_working_size(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size)
+{
+    uint32_t working_size = 0;
+    return (check_header(ctx, src, src_size, &working_size) == 0) ? 0 : working_size;
+}
+
+static uint32_t unscramble(gust_enc_ctx* ctx, uint8_t* payload, uint32_t payload_size,
+                           uint32_t* working_size)
+{
+    const gust_enc_seeds* seeds = &ctx->seeds;
+    uint32_t version = check_header(ctx, payload, payload_size, working_size);
+    if (version == 0)
+        return 0;
+    if (version != ctx->version) {
+        fprintf(stderr, "WARNING: Expected scrambler v%d file but got scrambler v%d\n",
+            ctx->version, version);
+    }
+    payload = &payload[E_HEADER_SIZE];
+    payload_size -= E_HEADER_SIZE;
+
+    // Revert the optional bit scrambling applied to the end of the file
+    if (version == 2) {
+        uint8_t* chunk = &payload[payload_size - min(payload_size, 0x800)];
+        init_random(ctx, 0, seeds->main[0]);
+        if (!bit_scrambler(ctx, chunk, min(payload_size, 0x800), 0x100, true))
+            return 0;
+    }
+
+    // Now call the fenced scrambler on the whole payload
+    init_random(ctx, 0, seeds->main[1]);
+    if (!fenced_scrambler(ctx, payload, payload_size, seeds->fence, true, (version == 3)))
+        return 0;
+
+    // Read the descrambled checksums footer (16 bytes)
+    uint32_t* footer = (uint32_t*)&payload[payload_size - E_FOOTER_SIZE];
+    payload_size -= E_FOOTER_SIZE;
+    if ((getdata32(ctx, footer) != 0) && (getdata32(ctx, footer) != 0x000000ff) && (getdata32(ctx, footer) != 0xff000000)) {
+        fprintf(stderr, "ERROR: Unexpected footer value: 0x%08x\n", getdata32(ctx, footer));
+        return 0;
+    }
+    // The 3rd checksum is probably leftover from the compression algorithm used
+#if defined(VALIDATE_CHECKSUM)
+    printf("3rd checksum = 0x%08x\n", getdata32(ctx, &footer[3]));
+#endif
+    uint32_t checksum[3] = { getdata32(ctx, &footer[1]), getdata32(ctx, &footer[2]), getdata32(ctx, &footer[3]) };
+
+    // Look for the bitstream_end marker and adjust our size
+    for (; (payload_size > 0) && (payload[payload_size] != 0xff); payload_size--);
+    if ((payload_size < sizeof(uint32_t)) || (payload[payload_size] != 0xff)) {
+        fprintf(stderr, "ERROR: End marker was not found\n");
+        return 0;
+    }
+    payload[payload_size] = 0x00;
+
+    if ((version == 3) && (checksum[2] != seeds->main[0])) {
+        fprintf(stderr, "ERROR: Unexpected end seed (wanted: 0x%08x, got: 0x%08x)\n",
+            seeds->main[0], checksum[2]);
+        return 0;
+    }
+
+    // Now call the rotating scrambler on the actual payload
+    init_random(ctx, checksum[2], seeds->table[0]);
+    if (!rotating_scrambler(ctx, payload, payload_size, seeds))
+        return 0;
+
+    // Validate the checksums
+    checksum[0] -= checksum_sub(ctx, payload, payload_size);
+    checksum[1] ^= checksum_xor(ctx, payload, payload_size);
+    if ((checksum[0] != 0) || (checksum[1] != 0)) {
+        fprintf(stderr, "ERROR: Descrambler checksum mismatch\n");
+        return 0;
+    }
+
+    // Zero 16 bytes from the end marker position
+    for (uint32_t i = 0; i < E_FOOTER_SIZE; i++)
+        payload[payload_size + i] = 0;
+
+    // Revert the optional bit scrambling applied to the start of the file
+    if (version == 2) {
+        init_random(ctx, checksum[2], seeds->main[2]);
+        if (!bit_scrambler(ctx, payload, min(payload_size, 0x800), 0x80, true))
+            return 0;
+    }
+
+    return payload_size;
+}
+
+uint32_t gust_enc_unscramble(gust_enc_ctx* ctx, uint8_t* buf, uint32_t buf_size, uint32_t* working_size)
+{
+    uint32_t r = unscramble(ctx, buf, buf_size, working_size);
+    arena_reset(&ctx->scratch);
+    return r;
+}
+
+// Returns the truncated integer square root of y using the Babylonian
+// iterative approximation method, derived from Newton's method.
+// This public domain function was written by George Gesslein II.
+static inline uint32_t lsqrt(uint32_t y)
+{
+    uint32_t x_old, x_new, testy;
+    int i, nbits;
+
+    if (y == 0)
+        return 0;
+
+    // Select a good starting value using binary logarithms
+    nbits = sizeof(y) * 8;
+    for (i = 4, testy = 16; ; i += 2, testy <<= 2) {
+        if (i >= nbits || y <= testy) {
+            x_old = (1 << (i / 2));	/* x_old = sqrt(testy) */
+            break;
+        }
+    }
+    // x_old >= sqrt(y)
+    // Use the Babylonian method to arrive at the integer square root
+    for (;;) {
+        x_new = (y / x_old + x_old) / 2;
+        if (x_old <= x_new)
+            break;
+        x_old = x_new;
+    }
+    return x_old;
+}
+
+// Returns true if 'n' is a prime number recorded in the table
+static inline int is_prime (const uint8_t* prime_list, uint32_t n)
+{
+    uint16_t bit = (uint16_t)n & 0x07;
+    return prime_list[n >> 3] & (1 << bit);
+}
+
+// Record 'n' as a prime number in the table
+static inline void set_prime (uint8_t* prime_list, uint32_t n)
+{
+    uint16_t bit = (uint16_t)n & 0x07;
+    prime_list[n >> 3] |= (1 << bit);
+}
+
+// Check whether 'n' is a prime number.
+static bool check_for_prime(const uint8_t* prime_list, uint32_t n)
+{
+    uint32_t i = 0;
+    const uint8_t* p;
+    uint32_t last_value;
+    bool small_n = ((n & 0xffff0000) == 0);
+
+    // We can stop when we have checked all prime numbers below sqrt(n)
+    last_value = lsqrt(n);
+
+    // Scan the bitmap of prime numbers and divide 'n' by the corresponding
+    // prime to see if it's a multiple of it.
+    p = prime_list;
+    do {
+        uint8_t val = *p++;
+        if (val) {
+            uint16_t q = (uint16_t)i;
+            for (uint16_t j = 1; val && j <= 0x80; j <<= 1, q++) {
+                if (val & j) {
+                    val &= ~j;
+                    // Use 16-bit division if 'n' is small enough.
+                    if (small_n) {
+                        uint16_t r = (uint16_t)n % (uint16_t)q;
+                        if (r == 0)
+                            return false;
+                    } else {
+                        uint32_t r = n % q;
+                        if (r == 0)
+                            return false;
+                    }
+                }
+            }
+        }
+        i += 8;
+    } while (i < last_value);
+    return true;
+}
+
+// Return a bitmap list of the prime numbers up to a specific value
+static uint8_t* compute_prime_list(uint32_t max_value)
+{
+    uint32_t i, cnt = 2;
+
+    uint8_t* prime_list = calloc((max_value + 8) / 8, 1);
+    if (prime_list == NULL)
+        return NULL;
+    for (i = 2; i <= max_value; i++) {
+        if (check_for_prime(prime_list, i)) {
+            set_prime(prime_list, i);
+            cnt++;
+        }
+    }
+    set_prime(prime_list, 0);
+    set_prime(prime_list, 1);
+    return prime_list;
+}
+
+bool gust_enc_check_seeds(const gust_enc_seeds* seeds)
+{
+    bool r = false;
+    uint32_t max_seed_value = seeds->fence;
+    for (size_t i = 0; i < array_size(seeds->main); i++) {
+        max_seed_value = max(max_seed_value, seeds->main[i]);
+        max_seed_value = max(max_seed_value, seeds->table[i]);
+        max_seed_value = max(max_seed_value, seeds->length[i]);
+    }
+    uint8_t* prime_list = compute_prime_list(max_seed_value);
+    if (prime_list == NULL)
+        return false;
+
+    for (size_t i = 0; i < array_size(seeds->main); i++) {
+        if (!is_prime(prime_list, seeds->main[i])) {
+            printf("ERROR: main[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->main[i]);
+            goto out;
+        }
+        if (!is_prime(prime_list, seeds->table[i])) {
+            printf("ERROR: table[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->table[i]);
+            goto out;
+        }
+        if (!is_prime(prime_list, seeds->length[i])) {
+            printf("ERROR: length[%d] (0x%02x) is not prime!\n", (uint32_t)i, seeds->length[i]);
+            goto out;
+        }
+    }
+    if (!is_prime(prime_list, seeds->fence)) {
+        printf("ERROR: fence (0x%04x) is not prime!\n", seeds->fence);
+        goto out;
+    }
+    r = true;
+
+out:
+    free(prime_list);
+    return r;
+}
+
+gust_enc_ctx* gust_enc_init(const gust_enc_seeds* seeds, uint32_t version)
+{
+    if ((version != 2) && (version != 3)) {
+        fprintf(stderr, "ERROR: Unsupported scrambler version %d\n", version);
+        return NULL;
+    }
+    gust_enc_ctx* ctx = calloc(1, sizeof(gust_enc_ctx));
+    if (ctx == NULL)
+        return NULL;
+    ctx->seeds = *seeds;
+    ctx->version = version;
+    ctx->big_endian = (version != 3);
+    ctx->level = GUST_ENC_DEFAULT_LEVEL;
+    return ctx;
+}
+
+void gust_enc_free(gust_enc_ctx* ctx)
+{
+    if (ctx == NULL)
+        return;
+    free_scrambling_cache(ctx);
+    arena_free(&ctx->scratch);
+    free(ctx);
+}
+
+uint32_t gust_enc_encode(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst)
+{
+    uint8_t* glazed = NULL;
+    uint32_t glazed_size;
+
+    *dst = NULL;
+    ctx->big_endian = (ctx->version != 3);
+#if defined(USE_GLAZED)
+    // The source is already Glaze compressed
+    glazed = malloc(src_size);
+    if (glazed == NULL)
+        return 0;
+    memcpy(glazed, src, src_size);
+    glazed_size = src_size;
+#else
+    glazed_size = gust_enc_glaze(ctx, src, src_size, &glazed);
+    if (glazed_size == 0)
+        return 0;
+#endif
+    // IMPORTANT: The Atelier executables allocate a working buffer of size 'working_size'
+    // for the decoding operation which must be at least the size of the uncompressed data
+    // or the size of the compressed stream plus the size of the bytecode table, whichever
+    // is largest (because this buffer will be zeroed for the size of the compressed stream
+    // plus the size of the bytecode table once decompression is complete).
+    uint32_t working_size = max(src_size, glazed_size + getdata32(ctx, &glazed[2 * sizeof(uint32_t)]));
+    uint32_t size = gust_enc_scramble(ctx, glazed, glazed_size, working_size, dst);
+    free(glazed);
+    return size;
+}
+
+uint32_t gust_enc_decode(gust_enc_ctx* ctx, const uint8_t* src, uint32_t src_size, uint8_t** dst)
+{
+    uint32_t working_size = 0, dst_size = 0;
+
+    *dst = NULL;
+    // Descrambling is done in place, so work on a copy
+    uint8_t* buf = malloc(src_size);
+    if (buf == NULL)
+        return 0;
+    memcpy(buf, src, src_size);
+    uint32_t payload_size = gust_enc_unscramble(ctx, buf, src_size, &working_size);
+    if (payload_size == 0)
+        goto out;
+    *dst = malloc(working_size);
+    if (*dst == NULL)
+        goto out;
+    dst_size = gust_enc_unglaze(ctx, &buf[E_HEADER_SIZE], payload_size, *dst, working_size);
+    if (dst_size == 0) {
+        free(*dst);
+        *dst = NULL;
+    }
+
+out:
+    free(buf);
+    return dst_size;
+}
@@ -86,6 +86,9 @@ const char* transform_op[] = {
 #define TRANSFORM_N     1
 #define NO_TILING       0
 
+// Scratch memory for the texture conversions, reset after each archive
+static arena scratch = { 0 };
+
 static size_t write_dds_header(FILE* fd, int format, uint32_t width,
                                uint32_t height, uint32_t mipmaps, uint32_t flags)
 {
@@ -197,7 +200,8 @@ static void transform(const uint32_t bits_per_pixel, const char* bit_order,
         rot[i] = (int32_t)((uintptr_t)strchr(bit_order, bit_pos[i]) - (uintptr_t)bit_order) - i;
     }
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    arena_pos pos = arena_save(&scratch);
+    uint8_t* tmp_buf = (uint8_t*)arena_alloc(&scratch, size);
     for (uint32_t i = 0; i < (size / bytes_per_pixel); i++) {
         uint32_t mask = 1;
         uint32_t src_index = 0;
@@ -213,7 +217,7 @@ static void transform(const uint32_t bits_per_pixel, const char* bit_order,
         }
     }
     memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    arena_restore(&scratch, pos);
 }
 
 static void tile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t width,
@@ -225,7 +229,8 @@ static void tile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t wid
     assert(size % bytes_per_pixel == 0);
     assert (size % (tile_size * tile_size) == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    arena_pos pos = arena_save(&scratch);
+    uint8_t* tmp_buf = (uint8_t*)arena_alloc(&scratch, size);
 
     for (uint32_t i = 0; i < size / bytes_per_pixel / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
@@ -239,7 +244,7 @@ static void tile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t wid
     }
 
     memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    arena_restore(&scratch, pos);
 }
 
 static void untile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t width,
@@ -252,7 +257,8 @@ static void untile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t w
     assert(size % (tile_size * tile_size) == 0);
     assert(width % tile_size == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    arena_pos pos = arena_save(&scratch);
+    uint8_t* tmp_buf = (uint8_t*)arena_alloc(&scratch, size);
 
     for (uint32_t i = 0; i < size / bytes_per_pixel / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
@@ -266,7 +272,7 @@ static void untile(const uint32_t bits_per_pixel, uint32_t tile_size, uint32_t w
     }
 
     memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    arena_restore(&scratch, pos);
 }
 
 static void flip(uint32_t bits_per_pixel, uint8_t* buf, const uint32_t size, uint32_t width)
@@ -276,16 +282,17 @@ static void flip(uint32_t bits_per_pixel, uint8_t* buf, const uint32_t size, uin
     assert(size % line_size == 0);
     const uint32_t max_line = (size / line_size) - 1;
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    arena_pos pos = arena_save(&scratch);
+    uint8_t* tmp_buf = (uint8_t*)arena_alloc(&scratch, size);
 
     for (uint32_t i = 0; i <= max_line; i++)
         memcpy(&tmp_buf[i * line_size], &buf[(max_line - i) * line_size], line_size);
 
     memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    arena_restore(&scratch, pos);
 }
 
-int main_utf8(int argc, char** argv)
+static int process_file(int argc, char** argv)
 {
     int r = -1;
     FILE *file = NULL;
@@ -299,8 +306,10 @@ int main_utf8(int argc, char** argv)
 
     if ((argc != 2) && !list_only && !flip_image) {
         printf("%s %s (c) 2019-2020 VitaSmith\n\n"
-            "Usage: %s [-l] [-f] <file or directory>\n\n"
+            "Usage: %s [-l] [-f] <file or directory> [...]\n\n"
             "Extracts (file) or recreates (directory) a Gust .g1t texture archive.\n\n"
+            "Several files can be processed at once, with @LIST reading the list of files\n"
+            "from LIST and '-' reading it from stdin.\n\n"
             "Note: A backup (.bak) of the original is automatically created, when the target\n"
             "is being overwritten for the first time.\n",
             appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]));
@@ -779,9 +788,18 @@ out:
     free(buf);
     free(dir);
     free(offset_table);
+    arena_reset(&scratch);
     if (file != NULL)
         fclose(file);
 
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = process_batch(argc, argv, "", process_file);
+    arena_free(&scratch);
+
     if (r != 0) {
         fflush(stdin);
         printf("\nPress any key to continue...");
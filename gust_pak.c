@@ -17,11 +17,16 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
 
 #include "utf8.h"
 #include "util.h"
@@ -51,12 +56,235 @@ typedef struct {
     uint64_t data_offset;
     uint64_t flags;
 } pak_entry64;
+
+// Header of the optional .pak.idx sidecar, which is followed by the decoded entries,
+// in table order, and by the indexes of these entries sorted by name.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t pak_size;
+    uint64_t pak_mtime;
+    uint64_t pak_hash;
+    uint32_t nb_files;
+    uint32_t entry_size;
+} pak_index_header;
 #pragma pack(pop)
 
-static __inline void decode(uint8_t* a, uint8_t* k, uint32_t size)
+#define PAK_INDEX_MAGIC     0x58444950  // 'PIDX'
+#define PAK_INDEX_VERSION   1
+
+// Size of the buffer used to decode entries. Must be a multiple of the key size.
+#define DECODE_CHUNK_SIZE   (1024 * 1024)
+
+// Keys are 0x20 bytes, so we XOR whole 32-byte blocks at once and only need to
+// handle the modulo for the tail. The best implementation is picked at runtime.
+static void decode_to_generic(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size)
+{
+    uint64_t k64[4], v[4];
+    uint32_t i;
+    memcpy(k64, k, sizeof(k64));
+    for (i = 0; i + 0x20 <= size; i += 0x20) {
+        memcpy(v, &src[i], sizeof(v));
+        v[0] ^= k64[0];
+        v[1] ^= k64[1];
+        v[2] ^= k64[2];
+        v[3] ^= k64[3];
+        memcpy(&dst[i], v, sizeof(v));
+    }
+    for (; i < size; i++)
+        dst[i] = src[i] ^ k[i % 0x20];
+}
+
+#if defined(USE_X86_SIMD)
+#include <immintrin.h>
+
+TARGET_SSE2 static void decode_to_sse2(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size)
+{
+    const __m128i k0 = _mm_loadu_si128((const __m128i*)k);
+    const __m128i k1 = _mm_loadu_si128((const __m128i*)&k[0x10]);
+    uint32_t i;
+    for (i = 0; i + 0x20 <= size; i += 0x20) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)&src[i]);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)&src[i + 0x10]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(v0, k0));
+        _mm_storeu_si128((__m128i*)&dst[i + 0x10], _mm_xor_si128(v1, k1));
+    }
+    for (; i < size; i++)
+        dst[i] = src[i] ^ k[i % 0x20];
+}
+
+TARGET_AVX2 static void decode_to_avx2(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size)
+{
+    const __m256i k256 = _mm256_loadu_si256((const __m256i*)k);
+    uint32_t i;
+    for (i = 0; i + 0x80 <= size; i += 0x80) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)&src[i]);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)&src[i + 0x20]);
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)&src[i + 0x40]);
+        __m256i v3 = _mm256_loadu_si256((const __m256i*)&src[i + 0x60]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(v0, k256));
+        _mm256_storeu_si256((__m256i*)&dst[i + 0x20], _mm256_xor_si256(v1, k256));
+        _mm256_storeu_si256((__m256i*)&dst[i + 0x40], _mm256_xor_si256(v2, k256));
+        _mm256_storeu_si256((__m256i*)&dst[i + 0x60], _mm256_xor_si256(v3, k256));
+    }
+    for (; i + 0x20 <= size; i += 0x20)
+        _mm256_storeu_si256((__m256i*)&dst[i],
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&src[i]), k256));
+    for (; i < size; i++)
+        dst[i] = src[i] ^ k[i % 0x20];
+}
+#endif
+
+static void (*decode_to)(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size) = decode_to_generic;
+
+// Must be called before any decoding, and before we spawn worker threads
+static void select_decoder(void)
+{
+#if defined(USE_X86_SIMD)
+    uint32_t features = get_cpu_features();
+    if (features & CPU_FEATURE_AVX2)
+        decode_to = decode_to_avx2;
+    else if (features & CPU_FEATURE_SSE2)
+        decode_to = decode_to_sse2;
+#endif
+}
+
+static __inline void decode(uint8_t* a, const uint8_t* k, uint32_t size)
+{
+    decode_to(a, a, k, size);
+}
+
+// Extract an entry either from a memory mapped archive or, if mapping was not
+// possible, from the archive file. Data is decoded in chunks so that we never
+// need a buffer the size of the entry, and not at all when the entry isn't keyed.
+// The content hash is computed on each chunk, while it's still in the cache.
+static bool extract_entry(FILE* file, const mapped_file* map, uint64_t offset, uint32_t size,
+                          uint8_t* key, bool skip_decode, uint8_t* chunk, const char* path,
+                          uint64_t* hash)
+{
+    bool r = false;
+    FILE* dst = NULL;
+    xxh64_state state;
+
+    if ((map->data != NULL) ? (offset + size > map->size) : (fseek64(file, offset, SEEK_SET) != 0)) {
+        fprintf(stderr, "ERROR: Can't read archive\n");
+        return false;
+    }
+    dst = fopen_utf8(path, "wb");
+    if (dst == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    xxh64_init(&state, 0);
+    for (uint32_t pos = 0, len; pos < size; pos += len) {
+        const uint8_t* data = chunk;
+        len = min(size - pos, DECODE_CHUNK_SIZE);
+        if (map->data == NULL) {
+            if (fread(chunk, 1, len, file) != len) {
+                fprintf(stderr, "ERROR: Can't read archive\n");
+                goto out;
+            }
+            if (!skip_decode)
+                decode(chunk, key, len);
+        } else if (!skip_decode) {
+            decode_to(chunk, &map->data[offset + pos], key, len);
+        } else {
+            // Plain entries can be written straight from the mapping
+            data = &map->data[offset + pos];
+        }
+        xxh64_update(&state, data, len);
+        if (fwrite(data, 1, len, dst) != len) {
+            fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
+            goto out;
+        }
+    }
+    *hash = xxh64_digest(&state);
+    r = true;
+
+out:
+    fclose(dst);
+    return r;
+}
+
+// Append data from an open file to the archive, encoding it through a fixed size buffer
+// so that memory usage doesn't depend on the size of the entry. On Linux, data that
+// doesn't need to be encoded is copied by the kernel instead, when the filesystem allows it.
+static bool copy_data(FILE* dst, FILE* src, uint64_t offset, uint32_t size, uint8_t* key,
+                      bool skip_encode, uint8_t* chunk, const char* path)
+{
+    uint32_t pos = 0, len;
+
+#if defined(__linux__)
+    if (skip_encode && (fflush(dst) == 0)) {
+        off64_t src_offset = (off64_t)offset, dst_offset = (off64_t)ftell64(dst);
+        while (pos < size) {
+            ssize_t n = copy_file_range(fileno(src), &src_offset, fileno(dst), &dst_offset, size - pos, 0);
+            if (n <= 0)
+                break;
+            pos += (uint32_t)n;
+        }
+        // Resume with a regular copy if the kernel couldn't do it all
+        if (fseek64(dst, dst_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "ERROR: Can't seek in archive\n");
+            return false;
+        }
+    }
+#endif
+    if (fseek64(src, offset + pos, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: Can't seek in '%s'\n", path);
+        return false;
+    }
+
+    for (; pos < size; pos += len) {
+        len = min(size - pos, DECODE_CHUNK_SIZE);
+        if (fread(chunk, 1, len, src) != len) {
+            fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+            return false;
+        }
+        if (!skip_encode)
+            decode(chunk, key, len);
+        if (fwrite(chunk, 1, len, dst) != len) {
+            fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compute the content hash of a file
+static bool hash_file(const char* path, uint32_t size, uint8_t* chunk, uint64_t* hash)
 {
-    for (uint32_t i = 0; i < size; i++)
-        a[i] ^= k[i % 0x20];
+    bool r = false;
+    xxh64_state state;
+    FILE* src = fopen_utf8(path, "rb");
+    if (src == NULL)
+        return false;
+    xxh64_init(&state, 0);
+    for (uint32_t pos = 0, len; pos < size; pos += len) {
+        len = min(size - pos, DECODE_CHUNK_SIZE);
+        if (fread(chunk, 1, len, src) != len)
+            goto out;
+        xxh64_update(&state, chunk, len);
+    }
+    *hash = xxh64_digest(&state);
+    r = true;
+
+out:
+    fclose(src);
+    return r;
+}
+
+static bool append_entry(FILE* dst, const char* path, uint32_t size, uint8_t* key,
+                         bool skip_encode, uint8_t* chunk)
+{
+    FILE* src = fopen_utf8(path, "rb");
+    if (src == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+        return false;
+    }
+    bool r = copy_data(dst, src, 0, size, key, skip_encode, chunk, path);
+    fclose(src);
+    return r;
 }
 
 static char* key_to_string(uint8_t* key)
@@ -84,34 +312,429 @@ static uint8_t* string_to_key(const char* str)
 // To handle either 32 or 64 bit PAK entries
 #define entries32 ((pak_entry32*)entries64)
 #define entry(i, m) (is_pak64 ? entries64[i].m :(entries32[i]).m)
+#define old_entry(i, m) (is_pak64 ? old_entries64[i].m :((pak_entry32*)old_entries64)[i].m)
 #define set_entry(i, m, v) do {if (is_pak64) entries64[i].m = v; else (entries32[i]).m = (uint32_t)(v);} while(0)
 
-int main_utf8(int argc, char** argv)
+static __inline bool is_key_empty(const uint8_t* key)
+{
+    int j;
+    for (j = 0; (j < 20) && (key[j] == 0); j++);
+    return (j >= 20);
+}
+
+// Keys are 0x20 bytes, but 32-bit entries only have 20 of them, and are encoded with
+// their data_offset and flags, followed by 4 zero bytes, since the original tool encoded
+// each entry before it set the name of the next one. Get the key an entry is encoded with.
+static __inline void get_key(pak_entry64* entries64, bool is_pak64, uint32_t i, uint8_t* key)
+{
+    memcpy(key, entry(i, key), 0x20);
+    if (!is_pak64)
+        memset(&key[sizeof(entries32[i].key) + 2 * sizeof(uint32_t)], 0, 4);
+}
+
+// Shared state for the extraction and repacking workers
+typedef struct {
+    const char* pak_path;
+    const mapped_file* map;
+    pak_entry64* entries64;
+    bool is_pak64;
+    const uint32_t* selected;   // Indexes of the entries to process, or NULL for all
+    uint32_t nb_files;
+    uint64_t file_data_offset;
+    const char* old_pak_path;   // Archive to copy unchanged entries from, when updating
+    const uint64_t* old_offsets;// Offset of each unchanged entry in the old archive, or UINT64_MAX
+    uint64_t* hashes;           // Content hashes, computed on extraction and checked on update
+    const bool* check_hash;     // Whether an entry can only be reused if its content hash matches
+    volatile uint32_t nb_reused;
+    volatile uint32_t next;
+    volatile uint32_t nb_errors;
+} pak_ctx;
+
+// Extraction worker. Entries are handed out in table order, and each worker uses its
+// own decode buffer and, when the archive isn't mapped, its own archive file handle.
+static void extract_worker(void* arg)
+{
+    pak_ctx* ctx = (pak_ctx*)arg;
+    pak_entry64* entries64 = ctx->entries64;
+    bool is_pak64 = ctx->is_pak64;
+    bool r = false;
+    FILE* file = NULL;
+    uint8_t* chunk = malloc(DECODE_CHUNK_SIZE);
+
+    if (chunk == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate decode buffer\n");
+        goto out;
+    }
+    if (ctx->map->data == NULL) {
+        file = fopen_utf8(ctx->pak_path, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't open PAK file '%s'\n", ctx->pak_path);
+            goto out;
+        }
+    }
+    for (uint32_t n = atomic_fetch_inc(&ctx->next); (n < ctx->nb_files) && (ctx->nb_errors == 0);
+        n = atomic_fetch_inc(&ctx->next)) {
+        uint32_t i = (ctx->selected == NULL) ? n : ctx->selected[n];
+        if (!extract_entry(file, ctx->map, entry(i, data_offset) + ctx->file_data_offset, entry(i, size),
+            entry(i, key), is_key_empty(entry(i, key)), chunk, &entry(i, filename)[1], &ctx->hashes[i]))
+            goto out;
+    }
+    r = true;
+
+out:
+    if (!r)
+        atomic_fetch_inc(&ctx->nb_errors);
+    free(chunk);
+    if (file != NULL)
+        fclose(file);
+}
+
+static __inline const char* skip_root(const char* path)
+{
+    while ((*path == '/') || (*path == '\\'))
+        path++;
+    return path;
+}
+
+static uint32_t hash_name(const char* name)
+{
+    uint32_t h = 0x811c9dc5;
+    for (name = skip_root(name); *name != 0; name++)
+        h = (h ^ (uint8_t)normalize_path_char(*name)) * 0x01000193;
+    return h;
+}
+
+static int compare_names(const char* a, const char* b)
+{
+    for (a = skip_root(a), b = skip_root(b); (*a != 0) && (normalize_path_char(*a) == normalize_path_char(*b)); a++, b++);
+    return (int)(uint8_t)normalize_path_char(*a) - (int)(uint8_t)normalize_path_char(*b);
+}
+
+static int compare_name_ptrs(const void* a, const void* b)
+{
+    return compare_names(*(const char**)a, *(const char**)b);
+}
+
+// Select the entries matching any of the patterns, in table order, and return their
+// count. Patterns without wildcards are looked up through the name sorted indexes if
+// we have them, or else through a hash index of the names, rather than by going
+// through all the entries.
+static uint32_t select_entries(pak_entry64* entries64, bool is_pak64, uint32_t nb_files,
+                               const uint32_t* sorted, const char** patterns, uint32_t nb_patterns,
+                               uint32_t* selected)
+{
+    uint32_t nb_selected = 0, mask = 0x3f, *index = NULL;
+    uint8_t* is_selected = calloc(nb_files, 1);
+
+    while (mask < 2 * nb_files)
+        mask = (mask << 1) | 1;
+    for (uint32_t p = 0; (p < nb_patterns) && (is_selected != NULL); p++) {
+        const char* pattern = skip_root(patterns[p]);
+        if (strpbrk(pattern, "*?") != NULL) {
+            for (uint32_t i = 0; i < nb_files; i++) {
+                if (match_glob(pattern, skip_root(entry(i, filename))))
+                    is_selected[i] = 1;
+            }
+            continue;
+        }
+        if (sorted != NULL) {
+            uint32_t lo = 0, hi = nb_files;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (compare_names(entry(sorted[mid], filename), pattern) < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            for (; (lo < nb_files) && (compare_names(entry(sorted[lo], filename), pattern) == 0); lo++)
+                is_selected[sorted[lo]] = 1;
+            continue;
+        }
+        // Slots hold the entry index + 1, so that 0 marks an empty slot
+        if (index == NULL) {
+            index = calloc((size_t)mask + 1, sizeof(uint32_t));
+            if (index == NULL)
+                break;
+            for (uint32_t i = 0; i < nb_files; i++) {
+                uint32_t h = hash_name(entry(i, filename)) & mask;
+                while (index[h] != 0)
+                    h = (h + 1) & mask;
+                index[h] = i + 1;
+            }
+        }
+        // Names should be unique, but make sure we pick up duplicates if they aren't
+        for (uint32_t h = hash_name(pattern) & mask; index[h] != 0; h = (h + 1) & mask) {
+            if (match_glob(pattern, skip_root(entry(index[h] - 1, filename))))
+                is_selected[index[h] - 1] = 1;
+        }
+    }
+    for (uint32_t i = 0; (i < nb_files) && (is_selected != NULL); i++) {
+        if (is_selected[i])
+            selected[nb_selected++] = i;
+    }
+    free(index);
+    free(is_selected);
+    return nb_selected;
+}
+
+// Compute the key that ties an index to a specific version of the archive
+static bool get_index_key(const char* pak_path, const pak_header* hdr, pak_index_header* key)
+{
+    struct stat64 st;
+    const uint8_t* p = (const uint8_t*)hdr;
+
+    if (stat64_utf8(pak_path, &st) != 0)
+        return false;
+    memset(key, 0, sizeof(*key));
+    key->magic = PAK_INDEX_MAGIC;
+    key->version = PAK_INDEX_VERSION;
+    key->pak_size = (uint64_t)st.st_size;
+    key->pak_mtime = (uint64_t)st.st_mtime;
+    key->pak_hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(pak_header); i++)
+        key->pak_hash = (key->pak_hash ^ p[i]) * 0x100000001b3ULL;
+    key->nb_files = hdr->nb_files;
+    return true;
+}
+
+// Load the decoded entries and name sorted indexes from an index file, provided that
+// it matches the current archive. Returns false if the index needs to be recreated.
+static bool load_index(const char* idx_path, const pak_index_header* key, uint32_t entry_size,
+                       pak_entry64* entries64, uint32_t* sorted)
+{
+    mapped_file map = { 0 };
+    bool r = false;
+
+    if (!is_file(idx_path) || !map_file(idx_path, &map))
+        return false;
+    const pak_index_header* idx = (const pak_index_header*)map.data;
+    size_t table_size = (size_t)key->nb_files * entry_size;
+    if ((map.size != sizeof(pak_index_header) + table_size + (size_t)key->nb_files * sizeof(uint32_t)) ||
+        (memcmp(idx, key, offsetof(pak_index_header, entry_size)) != 0) || (idx->entry_size != entry_size))
+        goto out;
+    memcpy(entries64, &map.data[sizeof(pak_index_header)], table_size);
+    memcpy(sorted, &map.data[sizeof(pak_index_header) + table_size], (size_t)key->nb_files * sizeof(uint32_t));
+    for (uint32_t i = 0; i < key->nb_files; i++) {
+        if (sorted[i] >= key->nb_files)
+            goto out;
+    }
+    r = true;
+
+out:
+    unmap_file(&map);
+    return r;
+}
+
+// Create an index file from decoded entries, and fill the name sorted indexes
+static bool save_index(const char* idx_path, pak_index_header* key, uint32_t entry_size,
+                       pak_entry64* entries64, uint32_t* sorted)
+{
+    bool r = false;
+    FILE* file = NULL;
+    const char** names = calloc(max(key->nb_files, 1), sizeof(char*));
+
+    if (names == NULL)
+        goto out;
+    for (uint32_t i = 0; i < key->nb_files; i++)
+        names[i] = &((const char*)entries64)[(size_t)i * entry_size];
+    qsort(names, key->nb_files, sizeof(char*), compare_name_ptrs);
+    for (uint32_t i = 0; i < key->nb_files; i++)
+        sorted[i] = (uint32_t)((names[i] - (const char*)entries64) / entry_size);
+
+    key->entry_size = entry_size;
+    file = fopen_utf8(idx_path, "wb");
+    if (file == NULL)
+        goto out;
+    if ((fwrite(key, sizeof(pak_index_header), 1, file) != 1) ||
+        (fwrite(entries64, entry_size, key->nb_files, file) != key->nb_files) ||
+        (fwrite(sorted, sizeof(uint32_t), key->nb_files, file) != key->nb_files))
+        goto out;
+    r = true;
+
+out:
+    free(names);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+// Read the decoded table of an existing archive, so that we can reuse its entries
+static pak_entry64* read_old_table(const char* path, bool is_pak64, pak_header* hdr)
+{
+    pak_entry64* entries64 = NULL;
+    FILE* file = fopen_utf8(path, "rb");
+
+    if (file == NULL)
+        return NULL;
+    if ((fread(hdr, sizeof(pak_header), 1, file) != 1) || (hdr->version != 0x20000) ||
+        (hdr->header_size != sizeof(pak_header)) || (hdr->nb_files > 16384)) {
+        fprintf(stderr, "ERROR: '%s' is not a valid PAK archive\n", path);
+        goto out;
+    }
+    entries64 = calloc(max(hdr->nb_files, 1), sizeof(pak_entry64));
+    if (entries64 == NULL)
+        goto out;
+    if (fread(entries64, is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32), hdr->nb_files, file) != hdr->nb_files) {
+        fprintf(stderr, "ERROR: Can't read PAK table from '%s'\n", path);
+        free(entries64);
+        entries64 = NULL;
+        goto out;
+    }
+    for (uint32_t i = 0; i < hdr->nb_files; i++) {
+        if (!is_key_empty(entry(i, key))) {
+            uint8_t key[0x20];
+            get_key(entries64, is_pak64, i, key);
+            decode((uint8_t*)entry(i, filename), key, 128);
+        }
+    }
+
+out:
+    fclose(file);
+    return entries64;
+}
+
+// Repacking worker. The archive layout has already been computed, so each worker
+// writes its entries at their final position, through its own archive file handle.
+static void repack_worker(void* arg)
+{
+    pak_ctx* ctx = (pak_ctx*)arg;
+    pak_entry64* entries64 = ctx->entries64;
+    bool is_pak64 = ctx->is_pak64;
+    bool r = false;
+    char path[256];
+    uint8_t key[0x20];
+    uint8_t* chunk = malloc(DECODE_CHUNK_SIZE);
+    FILE* file = fopen_utf8(ctx->pak_path, "rb+");
+    FILE* old_file = NULL;
+
+    if (chunk == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate encode buffer\n");
+        goto out;
+    }
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't open PAK file '%s'\n", ctx->pak_path);
+        goto out;
+    }
+    if (ctx->old_offsets != NULL) {
+        old_file = fopen_utf8(ctx->old_pak_path, "rb");
+        if (old_file == NULL) {
+            fprintf(stderr, "ERROR: Can't open PAK file '%s'\n", ctx->old_pak_path);
+            goto out;
+        }
+    }
+    for (uint32_t i = atomic_fetch_inc(&ctx->next); (i < ctx->nb_files) && (ctx->nb_errors == 0);
+        i = atomic_fetch_inc(&ctx->next)) {
+        // Entry names are only encoded once all the data has been written
+        strncpy(path, entry(i, filename), sizeof(path) - 1);
+        path[sizeof(path) - 1] = 0;
+        for (size_t n = 0; n < strlen(path); n++) {
+            if (path[n] == '\\')
+                path[n] = PATH_SEP;
+        }
+        if (fseek64(file, entry(i, data_offset) + ctx->file_data_offset, SEEK_SET) != 0) {
+            fprintf(stderr, "ERROR: Can't seek to data for '%s'\n", path);
+            goto out;
+        }
+        // Unchanged entries are copied as is, since they are already encoded. Files that
+        // were touched since extraction are only considered unchanged if their content is.
+        bool reuse = (ctx->old_offsets != NULL) && (ctx->old_offsets[i] != UINT64_MAX);
+        if (reuse && ctx->check_hash[i]) {
+            uint64_t hash;
+            reuse = hash_file(&path[1], entry(i, size), chunk, &hash) && (hash == ctx->hashes[i]);
+        }
+        if (reuse) {
+            atomic_fetch_inc(&ctx->nb_reused);
+            if (!copy_data(file, old_file, ctx->old_offsets[i], entry(i, size), NULL, true, chunk, ctx->old_pak_path))
+                goto out;
+            continue;
+        }
+        get_key(entries64, is_pak64, i, key);
+        if (!append_entry(file, &path[1], entry(i, size), key, is_key_empty(key), chunk))
+            goto out;
+    }
+    r = true;
+
+out:
+    if (!r)
+        atomic_fetch_inc(&ctx->nb_errors);
+    free(chunk);
+    if (file != NULL)
+        fclose(file);
+    if (old_file != NULL)
+        fclose(old_file);
+}
+
+static int process_file(int argc, char** argv)
 {
     int r = -1;
     FILE* file = NULL;
-    uint8_t* buf = NULL;
+    mapped_file map = { 0 };
     char path[256];
     pak_header hdr = { 0 };
     pak_entry64* entries64 = NULL;
     JSON_Value* json = NULL;
     bool is_pak64 = true;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
+    bool list_only = false, use_index = false, update = false;
+    uint32_t nb_threads = 1, nb_patterns = 0, *selected = NULL, *sorted = NULL;
+    char *idx_path = NULL, *tmp_path = NULL;
+    pak_header old_hdr = { 0 };
+    pak_entry64* old_entries64 = NULL;
+    uint64_t *old_offsets = NULL, *hashes = NULL;
+    bool* check_hash = NULL;
+    const char** patterns = calloc(argc, sizeof(char*));
+    int argn;
+
+    if (patterns == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate patterns\n");
+        return -1;
+    }
 
-    if ((argc != 2) && !list_only) {
+    for (argn = 1; (argn < argc - 1) && (argv[argn][0] == '-'); argn++) {
+        if (argv[argn][1] == 'l') {
+            list_only = true;
+        } else if (argv[argn][1] == 'i') {
+            use_index = true;
+        } else if (argv[argn][1] == 'u') {
+            update = true;
+        } else if (argv[argn][1] == 'x') {
+            // If a value is missing, the file is used instead, and we display the usage
+            patterns[nb_patterns++] = (argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn];
+        } else if (argv[argn][1] == 'j') {
+            nb_threads = (uint32_t)strtoul((argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn], NULL, 0);
+            if (nb_threads == 0)
+                nb_threads = get_nb_cores();
+        } else {
+            break;
+        }
+    }
+
+    if (argn != argc - 1) {
         printf("%s %s (c) 2018-2020 Yuri Hime & VitaSmith\n\n"
-            "Usage: %s [-l] <Gust PAK file>\n\n"
-            "Extracts (.pak) or recreates (.json) a Gust .pak archive.\n\n",
+            "Usage: %s [-l] [-i] [-u] [-j N] [-x PATTERN] <Gust PAK file> [...]\n\n"
+            "Extracts (.pak) or recreates (.json) a Gust .pak archive.\n\n"
+            "Options:\n"
+            "  -l          List the content of the archive\n"
+            "  -i          Use (or create) a .pak.idx index to speed up subsequent access\n"
+            "  -u          Update an existing archive, only re-encoding the files that\n"
+            "              were modified since extraction\n"
+            "  -j N        Extract or recreate using N threads (0 = one per CPU core)\n"
+            "  -x PATTERN  Only list or extract the entries matching PATTERN, where '*'\n"
+            "              and '?' can be used as wildcards. Can be repeated.\n\n"
+            "Several files can be processed at once, with @LIST reading the list of files\n"
+            "from LIST and '-' reading it from stdin.\n",
             appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]));
+        free(patterns);
         return 0;
     }
 
+    select_decoder();
+
     if (is_directory(argv[argc - 1])) {
         fprintf(stderr, "ERROR: Directory packing is not supported.\n"
             "To recreate a .pak you need to use the corresponding .json file.\n");
     } else if (strstr(argv[argc - 1], ".json") != NULL) {
-        if (list_only) {
-            fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
+        if (list_only || use_index || (nb_patterns != 0)) {
+            fprintf(stderr, "ERROR: Options -l, -i and -x are not supported when creating an archive\n");
             goto out;
         }
         json = json_parse_file_with_comments(argv[argc - 1]);
@@ -129,11 +752,31 @@ int main_utf8(int argc, char** argv)
         hdr.flags = json_object_get_uint32(json_object(json), "flags");
         hdr.nb_files = json_object_get_uint32(json_object(json), "nb_files");
         is_pak64 = json_object_get_boolean(json_object(json), "64-bit");
-        printf("Creating '%s'...\n", filename);
-        create_backup(filename);
-        file = fopen_utf8(filename, "wb+");
+        // When updating, the new archive is written alongside the existing one, since
+        // that's where we copy the unchanged entries from.
+        if (update && is_file(filename)) {
+            old_entries64 = read_old_table(filename, is_pak64, &old_hdr);
+            if (old_entries64 == NULL)
+                goto out;
+            tmp_path = malloc(strlen(filename) + 5);
+            old_offsets = calloc(max(hdr.nb_files, 1), sizeof(uint64_t));
+            hashes = calloc(max(hdr.nb_files, 1), sizeof(uint64_t));
+            check_hash = calloc(max(hdr.nb_files, 1), sizeof(bool));
+            if ((tmp_path == NULL) || (old_offsets == NULL) || (hashes == NULL) || (check_hash == NULL)) {
+                fprintf(stderr, "ERROR: Can't allocate update data\n");
+                goto out;
+            }
+            strcpy(tmp_path, filename);
+            strcat(tmp_path, ".tmp");
+            printf("Updating '%s'...\n", filename);
+        } else {
+            printf("Creating '%s'...\n", filename);
+            create_backup(filename);
+        }
+        const char* pak_path = (tmp_path != NULL) ? tmp_path : filename;
+        file = fopen_utf8(pak_path, "wb+");
         if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", filename);
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", pak_path);
             goto out;
         }
         if (fwrite(&hdr, sizeof(pak_header), 1, file) != 1) {
@@ -152,8 +795,14 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
         uint64_t file_data_offset = ftell64(file);
+        fflush(file);
 
+        // Since we know the size of every entry, we can compute the whole layout of
+        // the archive before we write any data.
+        uint64_t data_offset = 0;
         JSON_Array* json_files_array = json_object_get_array(json_object(json), "files");
+        // Time at which extraction completed, which is missing for older JSON files
+        uint64_t extracted = json_object_get_uint64(json_object(json), "extracted");
         printf("OFFSET    SIZE     NAME\n");
         for (uint32_t i = 0; i < hdr.nb_files; i++) {
             JSON_Object* file_entry = json_array_get_object(json_files_array, i);
@@ -165,36 +814,66 @@ int main_utf8(int argc, char** argv)
                 if (path[n] == '\\')
                     path[n] = PATH_SEP;
             }
-            set_entry(i, size, read_file(&path[1], &buf));
-            if (entry(i, size) == 0) {
+            struct stat64 st;
+            if ((stat64_utf8(&path[1], &st) != 0) || (st.st_size == 0)) {
                 fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
                 goto out;
             }
-            bool skip_encode = true;
-            for (int j = 0; j < 20; j++) {
-                entry(i, key)[j] = key[j];
-                if (key[j] != 0)
-                    skip_encode = false;
+            // PAK entry sizes are 32-bit, even in 64-bit archives
+            if ((uint64_t)st.st_size > UINT32_MAX) {
+                fprintf(stderr, "ERROR: '%s' is too large for a PAK entry\n", path);
+                goto out;
             }
+            set_entry(i, size, st.st_size);
+            for (int j = 0; j < 20; j++)
+                entry(i, key)[j] = key[j];
 
-            set_entry(i, data_offset, ftell64(file) - file_data_offset);
+            set_entry(i, data_offset, data_offset);
+            data_offset += entry(i, size);
             uint64_t flags = json_object_get_uint64(file_entry, "flags");
             if (is_pak64)
                 setbe64(&(entries64[i].flags), flags);
             else
                 setbe32(&(entries32[i].flags), (uint32_t)flags);
-            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
-                entry(i, size), entry(i, filename), skip_encode ? '*' : ' ');
-            if (!skip_encode) {
-                decode((uint8_t*)entry(i, filename), entry(i, key), 128);
-                decode(buf, entry(i, key), entry(i, size));
+            // An entry can be reused if its source file hasn't changed since extraction.
+            // Timestamps only have a resolution of one second, so a file that was written
+            // in the same second as extraction completed may have been modified with its
+            // mtime left unchanged, and we must compare its content then. Keyed 32-bit
+            // entries are also encoded with their offset and flags, see get_key().
+            if (old_offsets != NULL) {
+                const char* hash = json_object_get_string(file_entry, "hash");
+                uint64_t mtime = json_object_get_uint64(file_entry, "mtime");
+                old_offsets[i] = UINT64_MAX;
+                check_hash[i] = (mtime != (uint64_t)st.st_mtime) || (mtime >= extracted);
+                if (check_hash[i] && (hash != NULL))
+                    hashes[i] = strtoull(hash, NULL, 16);
+                if ((i < old_hdr.nb_files) && (compare_names(old_entry(i, filename), filename) == 0) &&
+                    (memcmp(old_entry(i, key), key, 20) == 0) && (old_entry(i, size) == (uint64_t)st.st_size) &&
+                    (json_object_get_uint64(file_entry, "size") == (uint64_t)st.st_size) &&
+                    (!check_hash[i] || (hash != NULL)) && (is_pak64 || is_key_empty(key) ||
+                    ((old_entry(i, data_offset) == entry(i, data_offset)) && (old_entry(i, flags) == entry(i, flags)))))
+                    old_offsets[i] = old_entry(i, data_offset) + sizeof(pak_header) +
+                        (uint64_t)old_hdr.nb_files * (is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32));
             }
-            if (fwrite(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
-                goto out;
+            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
+                entry(i, size), entry(i, filename), is_key_empty(entry(i, key)) ? '*' : ' ');
+        }
+
+        filename = json_object_get_string(json_object(json), "name");
+        pak_ctx ctx = { pak_path, NULL, entries64, is_pak64, NULL, hdr.nb_files, file_data_offset,
+                        filename, old_offsets, hashes, check_hash, 0, 0, 0 };
+        run_threads(min(nb_threads, max(hdr.nb_files, 1)), repack_worker, &ctx);
+        if (ctx.nb_errors != 0)
+            goto out;
+        if (old_offsets != NULL)
+            printf("\nReused %u unchanged entries out of %u\n", ctx.nb_reused, hdr.nb_files);
+
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            if (!is_key_empty(entry(i, key))) {
+                uint8_t key[0x20];
+                get_key(entries64, is_pak64, i, key);
+                decode((uint8_t*)entry(i, filename), key, 128);
             }
-            free(buf);
-            buf = NULL;
         }
         fseek64(file, sizeof(pak_header), SEEK_SET);
         if (fwrite(entries64, is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32),
@@ -202,8 +881,22 @@ int main_utf8(int argc, char** argv)
             fprintf(stderr, "ERROR: Can't write PAK table\n");
             goto out;
         }
+        if (tmp_path != NULL) {
+            fclose(file);
+            file = NULL;
+            create_backup(filename);
+            remove_utf8(filename);
+            if (rename_utf8(tmp_path, filename) != 0) {
+                fprintf(stderr, "ERROR: Can't rename '%s' to '%s'\n", tmp_path, filename);
+                goto out;
+            }
+        }
         r = 0;
     } else {
+        if (update) {
+            fprintf(stderr, "ERROR: Option -u is only supported when creating an archive\n");
+            goto out;
+        }
         printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", basename(argv[argc - 1]));
         file = fopen_utf8(argv[argc - 1], "rb");
         if (file == NULL) {
@@ -231,7 +924,24 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
 
-        if (fread(entries64, sizeof(pak_entry64), hdr.nb_files, file) != hdr.nb_files) {
+        // If we have a valid index, we can skip reading and decoding the table
+        pak_index_header idx_key;
+        bool have_index = false;
+        if (use_index) {
+            idx_path = malloc(strlen(argv[argc - 1]) + 5);
+            sorted = calloc(max(hdr.nb_files, 1), sizeof(uint32_t));
+            if ((idx_path == NULL) || (sorted == NULL)) {
+                fprintf(stderr, "ERROR: Can't allocate index\n");
+                goto out;
+            }
+            strcpy(idx_path, argv[argc - 1]);
+            strcat(idx_path, ".idx");
+            use_index = get_index_key(argv[argc - 1], &hdr, &idx_key);
+            have_index = use_index && load_index(idx_path, &idx_key,
+                is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32), entries64, sorted);
+        }
+
+        if (!have_index && (fread(entries64, sizeof(pak_entry64), hdr.nb_files, file) != hdr.nb_files)) {
             fprintf(stderr, "ERROR: Can't read PAK hdr\n");
             goto out;
         }
@@ -265,29 +975,58 @@ int main_utf8(int argc, char** argv)
 
         uint64_t file_data_offset = sizeof(pak_header) +
             (uint64_t)hdr.nb_files * (is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32));
-        JSON_Value* json_files_array = json_value_init_array();
-        printf("OFFSET    SIZE     NAME\n");
+        if (!have_index) {
+            for (uint32_t i = 0; i < hdr.nb_files; i++) {
+                if (!is_key_empty(entry(i, key)))
+                    decode((uint8_t*)entry(i, filename), entry(i, key), 128);
+            }
+            if (use_index && !save_index(idx_path, &idx_key,
+                is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32), entries64, sorted)) {
+                fprintf(stderr, "WARNING: Can't create index '%s'\n", idx_path);
+                use_index = false;
+            }
+        }
         for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            int j;
-            for (j = 0; (j < 20) && (entry(i, key)[j] == 0); j++);
-            bool skip_decode = (j >= 20);
-            if (!skip_decode)
-                decode((uint8_t*)entry(i, filename), entry(i, key), 128);
             for (size_t n = 0; n < strlen(entry(i, filename)); n++) {
                 if (entry(i, filename)[n] == '\\')
                     entry(i, filename)[n] = PATH_SEP;
             }
+        }
+
+        // Only process the entries matching the patterns, if any were provided
+        uint32_t nb_selected = hdr.nb_files;
+        if (nb_patterns != 0) {
+            selected = calloc(max(hdr.nb_files, 1), sizeof(uint32_t));
+            if (selected == NULL) {
+                fprintf(stderr, "ERROR: Can't allocate selection\n");
+                goto out;
+            }
+            nb_selected = select_entries(entries64, is_pak64, hdr.nb_files,
+                use_index ? sorted : NULL, patterns, nb_patterns, selected);
+            if (nb_selected == 0) {
+                fprintf(stderr, "ERROR: No entry matches the pattern(s) provided\n");
+                goto out;
+            }
+        }
+
+        JSON_Value* json_files_array = json_value_init_array();
+        printf("OFFSET    SIZE     NAME\n");
+        for (uint32_t n = 0; n < nb_selected; n++) {
+            uint32_t i = (selected == NULL) ? n : selected[n];
             printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
-                entry(i, size), entry(i, filename), skip_decode ? '*' : ' ');
+                entry(i, size), entry(i, filename), is_key_empty(entry(i, key)) ? '*' : ' ');
             if (list_only)
                 continue;
-            JSON_Value* json_file = json_value_init_object();
-            json_object_set_string(json_object(json_file), "name", entry(i, filename));
-            json_object_set_string(json_object(json_file), "key", key_to_string(entry(i, key)));
-            uint64_t flags = (is_pak64) ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
-            if (flags != 0)
-                json_object_set_number(json_object(json_file), "flags", (double)flags);
-            json_array_append_value(json_array(json_files_array), json_file);
+            // Partial extraction doesn't produce a JSON, since it couldn't be used to repack
+            if (selected == NULL) {
+                JSON_Value* json_file = json_value_init_object();
+                json_object_set_string(json_object(json_file), "name", entry(i, filename));
+                json_object_set_string(json_object(json_file), "key", key_to_string(entry(i, key)));
+                uint64_t flags = (is_pak64) ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
+                if (flags != 0)
+                    json_object_set_number(json_object(json_file), "flags", (double)flags);
+                json_array_append_value(json_array(json_files_array), json_file);
+            }
             strcpy(path, &entry(i, filename)[1]);
             for (size_t n = strlen(path); n > 0; n--) {
                 if (path[n] == PATH_SEP) {
@@ -299,38 +1038,66 @@ int main_utf8(int argc, char** argv)
                 fprintf(stderr, "ERROR: Can't create path '%s'\n", path);
                 goto out;
             }
-            fseek64(file, entry(i, data_offset) + file_data_offset, SEEK_SET);
-            buf = malloc(entry(i, size));
-            if (buf == NULL) {
-                fprintf(stderr, "ERROR: Can't allocate entries\n");
-                goto out;
-            }
-            if (fread(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't read archive\n");
-                goto out;
-            }
-            if (!skip_decode)
-                decode(buf, entry(i, key), entry(i, size));
-            if (!write_file(buf, entry(i, size), &entry(i, filename)[1], false))
-                goto out;
-            free(buf);
-            buf = NULL;
         }
 
         if (!list_only) {
             json_object_set_value(json_object(json), "files", json_files_array);
-            json_serialize_to_file_pretty(json, change_extension(argv[argc - 1], ".json"));
+            // Extract straight from a mapping of the archive when possible, and fall
+            // back to reading through the file (e.g. on 32-bit) when we can't map it.
+            map_file(argv[argc - 1], &map);
+            hashes = calloc(max(hdr.nb_files, 1), sizeof(uint64_t));
+            if (hashes == NULL) {
+                fprintf(stderr, "ERROR: Can't allocate hashes\n");
+                goto out;
+            }
+            pak_ctx ctx = { argv[argc - 1], &map, entries64, is_pak64, selected, nb_selected, file_data_offset,
+                            NULL, NULL, hashes, NULL, 0, 0, 0 };
+            run_threads(min(nb_threads, max(nb_selected, 1)), extract_worker, &ctx);
+            if (ctx.nb_errors != 0)
+                goto out;
+            if (selected == NULL) {
+                // Record the state of the extracted files, so that we can detect changes on update
+                json_object_set_number(json_object(json), "extracted", (double)time(NULL));
+                for (uint32_t i = 0; i < hdr.nb_files; i++) {
+                    struct stat64 st;
+                    JSON_Object* json_file = json_array_get_object(json_array(json_files_array), i);
+                    if (stat64_utf8(&entry(i, filename)[1], &st) != 0)
+                        continue;
+                    char hash[17];
+                    snprintf(hash, sizeof(hash), "%016" PRIx64, hashes[i]);
+                    json_object_set_string(json_file, "hash", hash);
+                    json_object_set_number(json_file, "size", (double)st.st_size);
+                    json_object_set_number(json_file, "mtime", (double)st.st_mtime);
+                }
+                json_serialize_to_file_pretty(json, change_extension(argv[argc - 1], ".json"));
+            }
         }
         r = 0;
     }
 
 out:
     json_value_free(json);
-    free(buf);
     free(entries64);
+    free(selected);
+    free(sorted);
+    free(idx_path);
+    free(tmp_path);
+    free(old_entries64);
+    free(old_offsets);
+    free(hashes);
+    free(check_hash);
+    free(patterns);
+    unmap_file(&map);
     if (file != NULL)
         fclose(file);
 
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = process_batch(argc, argv, "jx", process_file);
+
     if (r != 0) {
         fflush(stdin);
         printf("\nPress any key to continue...");
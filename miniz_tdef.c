@@ -25,6 +25,7 @@
  **************************************************************************/
 
 #include "miniz_tdef.h"
+#include "util.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,28 +52,9 @@ enum
 
 static mz_uint32 mz_adler32(mz_uint32 adler, const unsigned char* ptr, size_t buf_len)
 {
-    mz_uint32 s1 = (mz_uint32)(adler & 0xffff), s2 = (mz_uint32)(adler >> 16);
-    size_t i, block_len = buf_len % 5552;
     if (!ptr)
         return 1;
-    while (buf_len) {
-        for (i = 0; i + 7 < block_len; i += 8, ptr += 8) {
-            s1 += ptr[0], s2 += s1;
-            s1 += ptr[1], s2 += s1;
-            s1 += ptr[2], s2 += s1;
-            s1 += ptr[3], s2 += s1;
-            s1 += ptr[4], s2 += s1;
-            s1 += ptr[5], s2 += s1;
-            s1 += ptr[6], s2 += s1;
-            s1 += ptr[7], s2 += s1;
-        }
-        for (; i < block_len; ++i)
-            s1 += *ptr++, s2 += s1;
-        s1 %= 65521U, s2 %= 65521U;
-        buf_len -= block_len;
-        block_len = 5552;
-    }
-    return (s2 << 16) + s1;
+    return adler32(adler, ptr, buf_len);
 }
 
 /* Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/ */
@@ -0,0 +1,138 @@
+/*
+  bench_deflate - Benchmark of the gust_elixir compression backend
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../utf8.h"
+
+// Build gust_elixir itself, minus its entry point, so that we measure the backend it uses
+#pragma push_macro("CALL_MAIN")
+#undef CALL_MAIN
+#define CALL_MAIN
+#define main_utf8 gust_elixir_main_utf8
+#include "../gust_elixir.c"
+#undef main_utf8
+#pragma pop_macro("CALL_MAIN")
+
+#include "synth.h"
+
+#define BENCH_SIZE      (16 * 1024 * 1024)
+
+#if defined(USE_LIBDEFLATE)
+#define BACKEND_NAME    "libdeflate"
+#else
+#define BACKEND_NAME    "miniz"
+#endif
+
+// Compress and inflate data in DEFAULT_CHUNK_SIZE chunks, as gust_elixir does, on a
+// single thread, and check that we get the data back.
+static bool bench_level(int level, const uint8_t* src, uint32_t size, uint8_t* zbuf, uint32_t* zsizes)
+{
+    bool r = false;
+    uint8_t chunk[DEFAULT_CHUNK_SIZE];
+    uint32_t nb_chunks = (size + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE;
+    uint64_t total_zsize = 0;
+    deflater* c = deflater_alloc(level);
+    inflater* d = inflater_alloc();
+    if ((c == NULL) || (d == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate backend\n");
+        goto out;
+    }
+
+    uint64_t start_time = get_time_us();
+    for (uint32_t i = 0; i < nb_chunks; i++) {
+        size_t len = min(size - i * DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE);
+        zsizes[i] = (uint32_t)deflate_chunk(c, &zbuf[(size_t)i * MAX_ZCHUNK_SIZE], MAX_ZCHUNK_SIZE,
+            &src[(size_t)i * DEFAULT_CHUNK_SIZE], len);
+        if (zsizes[i] == 0) {
+            fprintf(stderr, "ERROR: Can't compress chunk %u\n", i);
+            goto out;
+        }
+        total_zsize += zsizes[i];
+    }
+    uint64_t deflate_time = get_time_us() - start_time;
+
+    start_time = get_time_us();
+    for (uint32_t i = 0; i < nb_chunks; i++) {
+        size_t len = min(size - i * DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_SIZE);
+        if ((inflate_chunk(d, chunk, DEFAULT_CHUNK_SIZE, &zbuf[(size_t)i * MAX_ZCHUNK_SIZE], zsizes[i]) != len) ||
+            (memcmp(chunk, &src[(size_t)i * DEFAULT_CHUNK_SIZE], len) != 0)) {
+            fprintf(stderr, "ERROR: Chunk %u doesn't inflate back to its data\n", i);
+            goto out;
+        }
+    }
+    uint64_t inflate_time = get_time_us() - start_time;
+
+    printf("%-10s -z %-2d ratio %.3f  deflate %7.1f MB/s  inflate %7.1f MB/s\n", BACKEND_NAME, level,
+        (double)total_zsize / size, (double)size / max(deflate_time, 1), (double)size / max(inflate_time, 1));
+    r = true;
+
+out:
+    deflater_free(c);
+    inflater_free(d);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    const int levels[] = { 1, DEFAULT_LEVEL, MAX_LEVEL };
+    int r = -1;
+    uint8_t *src = NULL, *zbuf = NULL;
+    uint32_t* zsizes = NULL;
+    uint32_t size = BENCH_SIZE, state = 0x12345678;
+
+    if (argc > 2) {
+        printf("Usage: %s [file]\n\n"
+            "Measures the %s backend of gust_elixir on a file, or on synthetic data.\n",
+            appname(argv[0]), BACKEND_NAME);
+        return 0;
+    }
+    if (argc == 2) {
+        size = read_file(argv[1], &src);
+        if (size == 0)
+            goto out;
+    } else {
+        src = malloc(size);
+        if (src == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate buffer\n");
+            goto out;
+        }
+        synth_fill(src, size, &state);
+    }
+    uint32_t nb_chunks = (size + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE;
+    zbuf = malloc((size_t)nb_chunks * MAX_ZCHUNK_SIZE);
+    zsizes = calloc(nb_chunks, sizeof(uint32_t));
+    if ((zbuf == NULL) || (zsizes == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        goto out;
+    }
+
+    printf("%s: %s, %u bytes in 0x%x chunks, one thread\n", appname(argv[0]),
+        (argc == 2) ? basename(argv[1]) : "synthetic data", size, DEFAULT_CHUNK_SIZE);
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (!bench_level(levels[i], src, size, zbuf, zsizes))
+            goto out;
+    }
+    r = 0;
+
+out:
+    free(src);
+    free(zbuf);
+    free(zsizes);
+    return r;
+}
+
+CALL_MAIN
@@ -0,0 +1,117 @@
+/*
+  bench_pak_decode - Benchmark of the gust_pak XOR decoders
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../utf8.h"
+
+// Build gust_pak itself, minus its entry point, so that we measure the actual decoders
+#pragma push_macro("CALL_MAIN")
+#undef CALL_MAIN
+#define CALL_MAIN
+#define main_utf8 gust_pak_main_utf8
+#include "../gust_pak.c"
+#undef main_utf8
+#pragma pop_macro("CALL_MAIN")
+
+#include "synth.h"
+
+#define BENCH_SIZE      (64 * 1024 * 1024)
+#define BENCH_RUNS      10
+
+typedef void (*decoder)(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size);
+
+// What the decoders must produce, and what the original byte loop did
+static void decode_reference(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+        dst[i] = src[i] ^ k[i % 0x20];
+}
+
+// Check every size up to a few blocks, at every alignment, to cover the tail handling
+static bool check_decoder(decoder decode_fn, const uint8_t* src, const uint8_t* k, uint8_t* buf)
+{
+    uint8_t ref[0x200];
+    for (uint32_t offset = 0; offset < 0x20; offset++) {
+        for (uint32_t size = 0; size <= sizeof(ref) - 0x20; size++) {
+            decode_reference(ref, &src[offset], k, size);
+            decode_fn(&buf[offset], &src[offset], k, size);
+            if (memcmp(ref, &buf[offset], size) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    struct {
+        const char* name;
+        decoder decode_fn;
+        uint32_t features;
+    } decoders[] = {
+        { "byte loop", decode_reference, 0 },
+        { "generic", decode_to_generic, 0 },
+#if defined(USE_X86_SIMD)
+        { "sse2", decode_to_sse2, CPU_FEATURE_SSE2 },
+        { "avx2", decode_to_avx2, CPU_FEATURE_AVX2 },
+#endif
+    };
+    int r = -1;
+    uint8_t key[0x20];
+    uint32_t state = 0x12345678, features = get_cpu_features();
+    uint8_t* src = malloc(BENCH_SIZE);
+    uint8_t* dst = malloc(BENCH_SIZE);
+    (void)argc;
+
+    if ((src == NULL) || (dst == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        goto out;
+    }
+    synth_fill(src, BENCH_SIZE, &state);
+    for (uint32_t i = 0; i < sizeof(key); i++)
+        key[i] = (uint8_t)synth_random(&state);
+
+    select_decoder();
+    printf("%s: XOR decoding of %d MB, best of %d runs\n", appname(argv[0]), BENCH_SIZE >> 20, BENCH_RUNS);
+    for (size_t i = 0; i < sizeof(decoders) / sizeof(decoders[0]); i++) {
+        if ((decoders[i].features & features) != decoders[i].features) {
+            printf("%-10s not supported by this CPU\n", decoders[i].name);
+            continue;
+        }
+        if (!check_decoder(decoders[i].decode_fn, src, key, dst)) {
+            fprintf(stderr, "ERROR: The %s decoder doesn't match the reference\n", decoders[i].name);
+            goto out;
+        }
+        uint64_t best = UINT64_MAX;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            uint64_t start_time = get_time_us();
+            decoders[i].decode_fn(dst, src, key, BENCH_SIZE);
+            uint64_t elapsed = get_time_us() - start_time;
+            best = min(best, max(elapsed, 1));
+        }
+        printf("%-10s %6.2f GB/s%s\n", decoders[i].name, (double)BENCH_SIZE / best / 1000.0,
+            (decoders[i].decode_fn == decode_to) ? " (selected)" : "");
+    }
+    r = 0;
+
+out:
+    free(src);
+    free(dst);
+    return r;
+}
+
+CALL_MAIN
@@ -0,0 +1,133 @@
+/*
+  check_elixir - Independent .elixir[.gz] conformance check, for the gust_elixir tests
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../utf8.h"
+#include "../util.h"
+
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ZLIB_APIS
+#define MINIZ_NO_MALLOC
+#include "../miniz_tinfl.h"
+
+// This is deliberately not shared with gust_elixir, so that we check its output against
+// what the game expects rather than against its own reader.
+#define EARC_MAGIC      0x45415243  // 'EARC'
+#define CHUNK_SIZE      0x4000
+#define HEADER_SIZE     (7 * sizeof(uint32_t))
+
+// Check that every chunk of a .elixir.gz is a zlib stream that inflates to exactly
+// CHUNK_SIZE bytes, except for the last one, and that the inflated data has the size
+// that its header says. Plain .elixir archives only have their size checked.
+int main_utf8(int argc, char** argv)
+{
+    int r = -1;
+    uint8_t *buf = NULL, *chunk = NULL, header[HEADER_SIZE];
+    uint32_t size, pos = 0, nb_chunks = 0, last_size = CHUNK_SIZE;
+    uint64_t total_size = 0;
+    tinfl_decompressor inflater;
+
+    if (argc != 2) {
+        printf("Usage: %s <elixir[.gz]>\n\n"
+            "Checks that an archive is made of the chunks that the game expects.\n",
+            appname(argv[0]));
+        return 0;
+    }
+    size = read_file(argv[1], &buf);
+    if (size < sizeof(uint32_t))
+        goto out;
+    // Room for more than a chunk, so that we can detect oversized ones
+    chunk = malloc(2 * CHUNK_SIZE);
+    if (chunk == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate chunk\n");
+        goto out;
+    }
+
+    uint64_t start_time = get_time_us();
+    if (getle32(buf) == EARC_MAGIC) {
+        memcpy(header, buf, min(size, HEADER_SIZE));
+        total_size = size;
+    } else {
+        while (1) {
+            if (pos + sizeof(uint32_t) > size) {
+                fprintf(stderr, "ERROR: Missing end marker\n");
+                goto out;
+            }
+            uint32_t zsize = getle32(&buf[pos]);
+            pos += sizeof(uint32_t);
+            if (zsize == 0)
+                break;
+            if (zsize > size - pos) {
+                fprintf(stderr, "ERROR: Chunk %u is truncated\n", nb_chunks);
+                goto out;
+            }
+            if (last_size != CHUNK_SIZE) {
+                fprintf(stderr, "ERROR: Chunk %u inflates to 0x%x bytes instead of 0x%x\n",
+                    nb_chunks - 1, last_size, CHUNK_SIZE);
+                goto out;
+            }
+            size_t in_size = zsize, out_size = 2 * CHUNK_SIZE;
+            tinfl_init(&inflater);
+            tinfl_status status = tinfl_decompress(&inflater, &buf[pos], &in_size, chunk, chunk, &out_size,
+                TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+            if ((status != TINFL_STATUS_DONE) || (in_size != zsize) || (out_size == 0) || (out_size > CHUNK_SIZE)) {
+                fprintf(stderr, "ERROR: Chunk %u is not a valid zlib stream of at most 0x%x bytes\n",
+                    nb_chunks, CHUNK_SIZE);
+                goto out;
+            }
+            if (total_size < HEADER_SIZE)
+                memcpy(&header[total_size], chunk, min(out_size, HEADER_SIZE - (size_t)total_size));
+            total_size += out_size;
+            last_size = (uint32_t)out_size;
+            pos += zsize;
+            nb_chunks++;
+        }
+        if (pos != size) {
+            fprintf(stderr, "ERROR: %u bytes of extra data after the end marker\n", size - pos);
+            goto out;
+        }
+    }
+    uint64_t elapsed = max(get_time_us() - start_time, 1);
+
+    if ((total_size < HEADER_SIZE) || (getle32(header) != EARC_MAGIC)) {
+        fprintf(stderr, "ERROR: Not an elixir archive\n");
+        goto out;
+    }
+    // The header, table and payload sizes add up to the size of the whole archive
+    uint64_t expected_size = (uint64_t)getle32(&header[8]) + getle32(&header[12]) + getle32(&header[16]);
+    if (total_size != expected_size) {
+        fprintf(stderr, "ERROR: Archive has 0x%llx bytes of data instead of 0x%llx\n",
+            (unsigned long long)total_size, (unsigned long long)expected_size);
+        goto out;
+    }
+    printf("%u %.1f\n", nb_chunks, (double)total_size / elapsed);
+    r = 0;
+
+out:
+    free(buf);
+    free(chunk);
+    return r;
+}
+
+CALL_MAIN
@@ -0,0 +1,108 @@
+#!/bin/sh
+# Round-trip and conformance test for gust_elixir, run by 'make test'.
+#
+# Synthetic archives are recreated at several compression levels, once with a single
+# thread and once with NB_THREADS. Both must be byte-identical, be made of the exact
+# 0x4000 chunks that the game expects, extract back to their sources, and be recreated
+# identically from the extracted files. Throughputs are reported along the way.
+#
+# Usage: tests/elixir_roundtrip.sh [NB_THREADS]
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+ELIXIR="$ROOT/gust_elixir$EXE"
+GEN="$ROOT/tests/gen_elixir$EXE"
+CHECK="$ROOT/tests/check_elixir$EXE"
+WORK="$ROOT/tests/work"
+NB_THREADS=${1:-4}
+LEVELS="0 1 7 10"
+nb_failed=0
+
+# Name, number of files, maximum file size and, for a plain .elixir, -p
+CASES="tiny:1:10 small:3:16384 mid:60:40000 big:100:400000 plain:20:40000:-p"
+
+fail()
+{
+  echo "FAIL: $*"
+  nb_failed=$((nb_failed + 1))
+}
+
+# Current time in ms, or nothing if date can't provide it
+now_ms()
+{
+  t=$(date +%s%N 2>/dev/null)
+  case $t in
+    *N|"") ;;
+    *) echo $((t / 1000000)) ;;
+  esac
+}
+
+# Recreate archive NAME from the sources with N threads at LEVEL, move it to DEST,
+# and print the throughput
+pack()
+{
+  t0=$(now_ms)
+  (cd "$WORK/src" && "$ELIXIR" -j $2 -z $3 $1 </dev/null >/dev/null) || return 1
+  t1=$(now_ms)
+  mv "$WORK/src/$1.$ext" "$4" || return 1
+  if [ -n "$t0" ] && [ -n "$t1" ]; then
+    awk "BEGIN { printf \"%.1f MB/s\", $src_size / 1000 / ($t1 - $t0 + 1) }"
+  else
+    echo "- MB/s"
+  fi
+}
+
+for tool in "$ELIXIR" "$GEN" "$CHECK"; do
+  if [ ! -x "$tool" ]; then
+    echo "ERROR: '$tool' has not been built"
+    exit 1
+  fi
+done
+
+rm -rf "$WORK"
+mkdir -p "$WORK/src" "$WORK/out" || exit 1
+echo "gust_elixir round trip, with -j $NB_THREADS"
+for spec in $CASES; do
+  IFS=:
+  set -- $spec
+  IFS=' '
+  name=$1
+  src_size=$(cd "$WORK/src" && "$GEN" $name $2 $3 $4) || { fail "$name: can't generate sources"; continue; }
+  if [ "$4" = "-p" ]; then
+    ext=elixir
+    levels=0
+  else
+    ext=elixir.gz
+    levels=$LEVELS
+  fi
+  for level in $levels; do
+    base=${name}_z$level
+    archive="$WORK/out/$base.$ext"
+    serial=$(pack $name 1 $level "$WORK/out/$base.serial") || { fail "$base: -j 1 repack failed"; continue; }
+    parallel=$(pack $name $NB_THREADS $level "$archive") || { fail "$base: -j $NB_THREADS repack failed"; continue; }
+    cmp -s "$WORK/out/$base.serial" "$archive" || { fail "$base: -j 1 and -j $NB_THREADS archives differ"; continue; }
+    result=$("$CHECK" "$archive") || { fail "$base: not made of 0x4000 chunks"; continue; }
+    "$ELIXIR" -t -j $NB_THREADS "$archive" </dev/null >/dev/null || fail "$base: rejected by gust_elixir -t"
+
+    # Extract, compare with the sources, and recreate the archive from what we extracted
+    (cd "$WORK/out" && "$ELIXIR" -j $NB_THREADS $base.$ext </dev/null >/dev/null) || { fail "$base: extraction failed"; continue; }
+    for file in "$WORK/src/$name"/*; do
+      file=$(basename "$file")
+      [ "$file" = elixir.json ] || cmp -s "$WORK/src/$name/$file" "$WORK/out/$base/$file" || fail "$base: $file differs"
+    done
+    mv "$archive" "$WORK/out/$base.ref"
+    (cd "$WORK/out" && "$ELIXIR" -j $NB_THREADS -z $level $base </dev/null >/dev/null) || { fail "$base: repack of extracted files failed"; continue; }
+    cmp -s "$archive" "$WORK/out/$base.ref" || fail "$base: repack of extracted files differs"
+
+    [ "$ext" = elixir ] && result="- -"
+    ratio=$(awk "BEGIN { printf \"%.3f\", $(wc -c < "$archive") / $src_size }")
+    printf "%-6s z%-2s %9d bytes, ratio %s, %4s chunk(s) | pack -j 1 %s, -j %d %s | inflate %s MB/s\n" \
+      $name $level $src_size $ratio ${result% *} "$serial" $NB_THREADS "$parallel" ${result#* }
+  done
+done
+
+if [ $nb_failed -ne 0 ]; then
+  echo "$nb_failed check(s) failed"
+  exit 1
+fi
+rm -rf "$WORK"
+echo "All checks passed"
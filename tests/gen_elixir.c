@@ -0,0 +1,107 @@
+/*
+  gen_elixir - Synthetic .elixir source generator, for the gust_elixir tests
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../utf8.h"
+#include "../util.h"
+#include "../parson.h"
+#include "synth.h"
+
+// Same value as the filename_size of the game archives
+#define FILENAME_SIZE   2
+
+// Create a directory that gust_elixir can turn into an archive, as if it had been
+// extracted from one: nb_files files of 1 to max_size bytes, and their elixir.json.
+int main_utf8(int argc, char** argv)
+{
+    static const char* extensions[] = { "g1t", "bin", "txt" };
+    int r = -1;
+    char path[256];
+    uint8_t* buf = NULL;
+    JSON_Value* json = NULL;
+    uint64_t total_size = 0;
+    bool plain = (argc == 5) && (strcmp(argv[4], "-p") == 0);
+
+    if ((argc != 4) && !plain) {
+        printf("Usage: %s <dir> <nb_files> <max_size> [-p]\n\n"
+            "Creates the source directory of a synthetic .elixir.gz archive, or of a\n"
+            "plain .elixir with -p. The same arguments always produce the same data.\n",
+            appname(argv[0]));
+        return 0;
+    }
+    uint32_t nb_files = (uint32_t)strtoul(argv[2], NULL, 0);
+    uint32_t max_size = (uint32_t)strtoul(argv[3], NULL, 0);
+    uint32_t state = 0x9e3779b9 ^ (nb_files * 0x10001) ^ max_size;
+    if ((nb_files == 0) || (max_size == 0)) {
+        fprintf(stderr, "ERROR: The number of files and their size must not be zero\n");
+        goto out;
+    }
+
+    buf = malloc(max_size);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffer\n");
+        goto out;
+    }
+    snprintf(path, sizeof(path), "%s", argv[1]);
+    if (!create_path(path))
+        goto out;
+
+    json = json_value_init_object();
+    JSON_Value* json_files_array = json_value_init_array();
+    for (uint32_t i = 0; i < nb_files; i++) {
+        char name[32];
+        uint32_t size = 1 + synth_random(&state) % max_size;
+        snprintf(name, sizeof(name), "file%04u.%s", i, extensions[i % 3]);
+        synth_fill(buf, size, &state);
+        snprintf(path, sizeof(path), "%s%c%s", argv[1], PATH_SEP, name);
+        if (!write_file(buf, size, path, false))
+            goto out;
+        json_array_append_string(json_array(json_files_array), name);
+        total_size += size;
+    }
+    snprintf(path, sizeof(path), "%s.elixir%s", basename(argv[1]), plain ? "" : ".gz");
+    json_object_set_string(json_object(json), "name", path);
+    json_object_set_boolean(json_object(json), "compressed", !plain);
+    json_object_set_number(json_object(json), "filename_size", FILENAME_SIZE);
+    json_object_set_number(json_object(json), "flags", 0);
+    json_object_set_number(json_object(json), "header_size", 7 * sizeof(uint32_t));
+    json_object_set_number(json_object(json), "table_size",
+        nb_files * (2 * sizeof(uint32_t) + 0x20 + (FILENAME_SIZE << 4)));
+    json_object_set_number(json_object(json), "nb_files", nb_files);
+    json_object_set_value(json_object(json), "files", json_files_array);
+    snprintf(path, sizeof(path), "%s%celixir.json", argv[1], PATH_SEP);
+    if (json_serialize_to_file_pretty(json, path) != JSONSuccess) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+        goto out;
+    }
+    // The runner uses this to compute throughputs
+    printf("%" PRIu64 "\n", total_size);
+    r = 0;
+
+out:
+    json_value_free(json);
+    free(buf);
+    return r;
+}
+
+CALL_MAIN
@@ -0,0 +1,123 @@
+/*
+  gen_pak - Synthetic .pak source generator, for the gust_pak tests
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../utf8.h"
+#include "../util.h"
+#include "../parson.h"
+#include "synth.h"
+
+// Create the files and JSON that gust_pak recreates an archive from, as if they had
+// been extracted from one: nb_files files of 1 to max_size bytes, in subdirectories
+// so that entry names are longer than a key. Every fourth entry has no key, and the
+// JSON records the state of the files, so that the archive can also be updated.
+int main_utf8(int argc, char** argv)
+{
+    static const char* extensions[] = { "g1t", "bin", "txt" };
+    int r = -1;
+    char name[128], path[256];
+    uint8_t* buf = NULL;
+    JSON_Value* json = NULL;
+    bool is_pak64 = !((argc == 5) && (strcmp(argv[4], "-32") == 0));
+
+    if ((argc != 4) && is_pak64) {
+        printf("Usage: %s <name> <nb_files> <max_size> [-32]\n\n"
+            "Creates the sources and JSON of a synthetic <name>.pak archive, with 64-bit\n"
+            "entries or, with -32, 32-bit ones. The same arguments always produce the\n"
+            "same data.\n",
+            appname(argv[0]));
+        return 0;
+    }
+    uint32_t nb_files = (uint32_t)strtoul(argv[2], NULL, 0);
+    uint32_t max_size = (uint32_t)strtoul(argv[3], NULL, 0);
+    uint32_t state = 0x9e3779b9 ^ (nb_files * 0x10001) ^ max_size;
+    if ((nb_files == 0) || (max_size == 0)) {
+        fprintf(stderr, "ERROR: The number of files and their size must not be zero\n");
+        goto out;
+    }
+
+    buf = malloc(max_size);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffer\n");
+        goto out;
+    }
+
+    json = json_value_init_object();
+    snprintf(path, sizeof(path), "%s.pak", argv[1]);
+    json_object_set_string(json_object(json), "name", path);
+    json_object_set_number(json_object(json), "version", 0x20000);
+    json_object_set_number(json_object(json), "header_size", 4 * sizeof(uint32_t));
+    json_object_set_number(json_object(json), "flags", 0);
+    json_object_set_number(json_object(json), "nb_files", nb_files);
+    json_object_set_boolean(json_object(json), "64-bit", is_pak64);
+    JSON_Value* json_files_array = json_value_init_array();
+    for (uint32_t i = 0; i < nb_files; i++) {
+        char key[41], hash[17];
+        uint32_t size = 1 + synth_random(&state) % max_size;
+        snprintf(name, sizeof(name), "\\%s\\data%02u\\synthetic_entry_%04u.%s", argv[1], i % 4, i, extensions[i % 3]);
+        snprintf(path, sizeof(path), "%s%cdata%02u", argv[1], PATH_SEP, i % 4);
+        if (!create_path(path))
+            goto out;
+        snprintf(path, sizeof(path), "%s%cdata%02u%csynthetic_entry_%04u.%s", argv[1], PATH_SEP, i % 4,
+            PATH_SEP, i, extensions[i % 3]);
+        synth_fill(buf, size, &state);
+        if (!write_file(buf, size, path, false))
+            goto out;
+        for (int j = 0; j < 40; j += 8)
+            snprintf(&key[j], 9, "%08x", (i % 4 == 3) ? 0 : synth_random(&state));
+        xxh64_state xxh;
+        xxh64_init(&xxh, 0);
+        xxh64_update(&xxh, buf, size);
+        snprintf(hash, sizeof(hash), "%016" PRIx64, xxh64_digest(&xxh));
+        struct stat64 st;
+        if (stat64_utf8(path, &st) != 0) {
+            fprintf(stderr, "ERROR: Can't stat '%s'\n", path);
+            goto out;
+        }
+        JSON_Value* json_file = json_value_init_object();
+        json_object_set_string(json_object(json_file), "name", name);
+        json_object_set_string(json_object(json_file), "key", key);
+        if (i % 5 == 1)
+            json_object_set_number(json_object(json_file), "flags", i);
+        json_object_set_string(json_object(json_file), "hash", hash);
+        json_object_set_number(json_object(json_file), "size", size);
+        json_object_set_number(json_object(json_file), "mtime", (double)st.st_mtime);
+        json_array_append_value(json_array(json_files_array), json_file);
+    }
+    json_object_set_number(json_object(json), "extracted", (double)time(NULL));
+    json_object_set_value(json_object(json), "files", json_files_array);
+    snprintf(path, sizeof(path), "%s.json", argv[1]);
+    if (json_serialize_to_file_pretty(json, path) != JSONSuccess) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+        goto out;
+    }
+    r = 0;
+
+out:
+    json_value_free(json);
+    free(buf);
+    return r;
+}
+
+CALL_MAIN
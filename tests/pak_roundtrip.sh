@@ -0,0 +1,73 @@
+#!/bin/sh
+# Repacking test for gust_pak, run by 'make test'.
+#
+# Synthetic archives, with 64 and 32-bit entries, are recreated once with a single
+# thread and once with NB_THREADS, and must be byte-identical to the archive that the
+# original sequential gust_pak produces from the same sources. They are then updated
+# with -u, as is and after an early file grew, which moves all the entries after it,
+# and must still be identical to the reference.
+#
+# Usage: tests/pak_roundtrip.sh [NB_THREADS]
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PAK="$ROOT/gust_pak$EXE"
+GEN="$ROOT/tests/gen_pak$EXE"
+REF="$ROOT/tests/ref_pak$EXE"
+WORK="$ROOT/tests/work/pak"
+NB_THREADS=${1:-4}
+nb_failed=0
+
+# Name, number of files, maximum file size and, for 32-bit entries, -32
+CASES="k64:40:70000 k32:40:70000:-32 one32:1:5000:-32"
+
+fail()
+{
+  echo "FAIL: $*"
+  nb_failed=$((nb_failed + 1))
+}
+
+# Recreate archive NAME with N threads, and check it against the reference. With -u,
+# set reused to the number of entries that were reused.
+repack()
+{
+  out=$("$PAK" $3 -j $2 $1.json </dev/null) || { fail "$1: -j $2 $3 repack failed"; return 1; }
+  cmp -s $1.pak $1.ref || { fail "$1: -j $2 $3 archive differs from the reference"; return 1; }
+  reused=$(echo "$out" | sed -n 's/^Reused \([0-9]*\) .* out of \([0-9]*\)$/\1\/\2/p')
+}
+
+for tool in "$PAK" "$GEN" "$REF"; do
+  if [ ! -x "$tool" ]; then
+    echo "ERROR: '$tool' has not been built"
+    exit 1
+  fi
+done
+
+rm -rf "$WORK"
+mkdir -p "$WORK" || exit 1
+cd "$WORK" || exit 1
+echo "gust_pak repack, with -j 1 and -j $NB_THREADS"
+for spec in $CASES; do
+  IFS=:
+  set -- $spec
+  IFS=' '
+  name=$1
+  "$GEN" $name $2 $3 $4 >/dev/null || { fail "$name: can't generate sources"; continue; }
+  "$REF" $name.json $name.ref >/dev/null || { fail "$name: can't create reference archive"; continue; }
+  repack $name 1 && repack $name $NB_THREADS && repack $name $NB_THREADS -u || continue
+  unchanged=$reused
+
+  # Grow the first file, and update the reference accordingly
+  file=$(echo $name/data00/*_0000.*)
+  printf 'grown' >> $file
+  "$REF" $name.json $name.ref >/dev/null || { fail "$name: can't create reference archive"; continue; }
+  repack $name $NB_THREADS -u || continue
+  echo "$name: $(wc -c < $name.pak) bytes, identical to the reference | -u reused $unchanged entries, then $reused"
+done
+
+cd "$ROOT"
+if [ $nb_failed -ne 0 ]; then
+  echo "$nb_failed check(s) failed"
+  exit 1
+fi
+rm -rf "$WORK"
+echo "All checks passed"
@@ -0,0 +1,181 @@
+/*
+  ref_pak - Reference .pak writer, for the gust_pak tests
+  Copyright © 2019-2020 VitaSmith
+  Copyright © 2018 Yuri Hime (shizukachan)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../utf8.h"
+#include "../util.h"
+#include "../parson.h"
+
+// This is deliberately not shared with gust_pak: it's the sequential repacking of the
+// original tool, which gust_pak must produce the exact same archives as.
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t version;
+    uint32_t nb_files;
+    uint32_t header_size;
+    uint32_t flags;
+} pak_header;
+
+typedef struct {
+    char     filename[128];
+    uint32_t size;
+    uint8_t  key[20];
+    uint32_t data_offset;
+    uint32_t flags;
+} pak_entry32;
+
+typedef struct {
+    char     filename[128];
+    uint32_t size;
+    uint8_t  key[0x20];
+    uint32_t unknown0xa4;
+    uint64_t data_offset;
+    uint64_t flags;
+} pak_entry64;
+#pragma pack(pop)
+
+#define entries32 ((pak_entry32*)entries64)
+#define entry(i, m) (is_pak64 ? entries64[i].m :(entries32[i]).m)
+#define set_entry(i, m, v) do {if (is_pak64) entries64[i].m = v; else (entries32[i]).m = (uint32_t)(v);} while(0)
+
+// The key of a 32-bit entry runs into the fields that follow it, which is why the
+// order in which entries are filled and encoded below matters.
+static void decode(uint8_t* a, const uint8_t* k, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+        a[i] ^= k[i % 0x20];
+}
+
+static uint8_t hex_to_nibble(char c)
+{
+    return (uint8_t)((c >= 'a') ? c - 'a' + 10 : c - '0');
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1;
+    char path[256];
+    uint8_t* buf = NULL;
+    FILE* file = NULL;
+    pak_header hdr = { 0 };
+    pak_entry64* entries64 = NULL;
+    JSON_Value* json = NULL;
+
+    if (argc != 3) {
+        printf("Usage: %s <json> <pak>\n\n"
+            "Creates the archive described by a gust_pak JSON file, the way the original\n"
+            "gust_pak did, so that the output of the current one can be compared to it.\n",
+            appname(argv[0]));
+        return 0;
+    }
+    json = json_parse_file_with_comments(argv[1]);
+    if (json == NULL) {
+        fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[1]);
+        goto out;
+    }
+    hdr.version = json_object_get_uint32(json_object(json), "version");
+    hdr.header_size = json_object_get_uint32(json_object(json), "header_size");
+    hdr.flags = json_object_get_uint32(json_object(json), "flags");
+    hdr.nb_files = json_object_get_uint32(json_object(json), "nb_files");
+    bool is_pak64 = json_object_get_boolean(json_object(json), "64-bit");
+    JSON_Array* json_files_array = json_object_get_array(json_object(json), "files");
+    if ((hdr.header_size != sizeof(pak_header)) || (json_files_array == NULL) ||
+        (json_array_get_count(json_files_array) != hdr.nb_files)) {
+        fprintf(stderr, "ERROR: Invalid JSON data\n");
+        goto out;
+    }
+    entries64 = calloc(max(hdr.nb_files, 1), sizeof(pak_entry64));
+    file = fopen_utf8(argv[2], "wb");
+    if ((entries64 == NULL) || (file == NULL)) {
+        fprintf(stderr, "ERROR: Can't create '%s'\n", argv[2]);
+        goto out;
+    }
+    size_t entry_size = is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32);
+    if ((fwrite(&hdr, sizeof(hdr), 1, file) != 1) ||
+        (fwrite(entries64, entry_size, hdr.nb_files, file) != hdr.nb_files)) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", argv[2]);
+        goto out;
+    }
+
+    uint64_t data_offset = 0;
+    for (uint32_t i = 0; i < hdr.nb_files; i++) {
+        JSON_Object* file_entry = json_array_get_object(json_files_array, i);
+        const char* name = json_object_get_string(file_entry, "name");
+        const char* key = json_object_get_string(file_entry, "key");
+        if ((name == NULL) || (key == NULL) || (strlen(key) != 40)) {
+            fprintf(stderr, "ERROR: Invalid JSON data for entry %u\n", i);
+            goto out;
+        }
+        strncpy(entry(i, filename), name, 127);
+        snprintf(path, sizeof(path), "%s", &name[1]);
+        for (size_t n = 0; n < strlen(path); n++) {
+            if (path[n] == '\\')
+                path[n] = PATH_SEP;
+        }
+        uint32_t size = read_file(path, &buf);
+        if (size == 0)
+            goto out;
+        set_entry(i, size, size);
+        bool skip_encode = true;
+        for (int j = 0; j < 20; j++) {
+            entry(i, key)[j] = (uint8_t)((hex_to_nibble(key[2 * j]) << 4) | hex_to_nibble(key[2 * j + 1]));
+            if (entry(i, key)[j] != 0)
+                skip_encode = false;
+        }
+        set_entry(i, data_offset, data_offset);
+        uint64_t flags = json_object_get_uint64(file_entry, "flags");
+        if (is_pak64)
+            setbe64(&(entries64[i].flags), flags);
+        else
+            setbe32(&(entries32[i].flags), (uint32_t)flags);
+        // The next entry is still blank at this stage
+        if (!skip_encode) {
+            decode((uint8_t*)entry(i, filename), entry(i, key), 128);
+            decode(buf, entry(i, key), size);
+        }
+        if (fwrite(buf, 1, size, file) != size) {
+            fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
+            goto out;
+        }
+        data_offset += size;
+        free(buf);
+        buf = NULL;
+    }
+    if ((fseek(file, sizeof(pak_header), SEEK_SET) != 0) ||
+        (fwrite(entries64, entry_size, hdr.nb_files, file) != hdr.nb_files)) {
+        fprintf(stderr, "ERROR: Can't write PAK table\n");
+        goto out;
+    }
+    r = 0;
+
+out:
+    json_value_free(json);
+    free(entries64);
+    free(buf);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+CALL_MAIN
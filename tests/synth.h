@@ -0,0 +1,59 @@
+/*
+  synth - Synthetic data for the Gust Tools tests and benchmarks
+  Copyright © 2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#pragma once
+
+// xorshift32, so that the same seed always produces the same data on every platform
+static __inline uint32_t synth_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Fill a buffer with a mix of words and noise, which compresses about as well as
+// the scripts and tables found in game archives.
+static __inline void synth_fill(uint8_t* buf, size_t size, uint32_t* state)
+{
+    static const char* words[] = { "alpha", "beta", "gamma", "delta", "<item id=\"", "\"/>\n" };
+    size_t pos = 0;
+    while (pos < size) {
+        uint32_t r = synth_random(state);
+        uint8_t noise[4];
+        const uint8_t* src = noise;
+        size_t len = sizeof(noise);
+        if (r % 5 != 0) {
+            src = (const uint8_t*)words[(r >> 8) % (sizeof(words) / sizeof(words[0]))];
+            len = strlen((const char*)src);
+        } else {
+            r = synth_random(state);
+            memcpy(noise, &r, sizeof(noise));
+        }
+        if (len > size - pos)
+            len = size - pos;
+        memcpy(&buf[pos], src, len);
+        pos += len;
+    }
+}
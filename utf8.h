@@ -34,6 +34,7 @@
 
 #if defined(_WIN32)
 #include <windows.h>
+#include <share.h>
 #define stat64 _stat64
 
 static __inline char* utf16_to_utf8(const wchar_t* str16)
@@ -79,12 +80,13 @@ static __inline wchar_t* utf8_to_utf16(const char* str8)
     return str16;
 }
 
+// Files are opened in shared mode, so that worker threads can open their own handles
 static __inline FILE* fopen_utf8(const char* filename, const char* mode)
 {
     FILE* r = NULL;
     wchar_t* filename16 = utf8_to_utf16(filename);
     wchar_t* mode16 = utf8_to_utf16(mode);
-    _wfopen_s(&r, filename16, mode16);
+    r = _wfsopen(filename16, mode16, _SH_DENYNO);
     free(filename16);
     free(mode16);
     return r;
@@ -100,6 +102,14 @@ static __inline int rename_utf8(const char* oldname, const char* newname)
     return r;
 }
 
+static __inline int remove_utf8(const char* path)
+{
+    wchar_t* path16 = utf8_to_utf16(path);
+    int r = _wremove(path16);
+    free(path16);
+    return r;
+}
+
 static __inline int stat64_utf8(const char* path, struct stat64* buffer)
 {
     int r;
@@ -124,6 +134,7 @@ static __inline int stat64_utf8(const char* path, struct stat64* buffer)
 #else
 #define fopen_utf8 fopen
 #define rename_utf8 rename
+#define remove_utf8 remove
 #define stat64_utf8 stat64
 #define CALL_MAIN int main(int argc, char** argv) {         \
     return main_utf8(argc, argv);                           \
@@ -20,6 +20,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
 
 #include "utf8.h"
 #include "util.h"
@@ -50,9 +58,10 @@ bool create_path(char* path)
             free(new_path);
             path[pos] = PATH_SEP;
         }
-        // Create node
+        // Create node. We may be racing another thread creating the same
+        // directory, so it's only an error if the directory still isn't there.
         if (result)
-            result = CREATE_DIR(path);
+            result = CREATE_DIR(path) || is_directory(path);
     } else if (!S_ISDIR(st.st_mode)) {
         fprintf(stderr, "ERROR: '%s' exists but isn't a directory\n", path);
         return false;
@@ -61,6 +70,128 @@ bool create_path(char* path)
     return result;
 }
 
+#if defined(_MSC_VER) && defined(USE_X86_SIMD)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+uint32_t get_cpu_features(void)
+{
+    uint32_t features = 0;
+#if defined(USE_X86_SIMD)
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    if (regs[3] & (1 << 26))
+        features |= CPU_FEATURE_SSE2;
+    if (regs[2] & (1 << 9))
+        features |= CPU_FEATURE_SSSE3;
+    // AVX2 also requires the OS to save the YMM registers
+    if ((max_leaf >= 7) && (regs[2] & (1 << 27)) && ((_xgetbv(0) & 6) == 6)) {
+        __cpuidex(regs, 7, 0);
+        if (regs[1] & (1 << 5))
+            features |= CPU_FEATURE_AVX2;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        features |= CPU_FEATURE_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        features |= CPU_FEATURE_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= CPU_FEATURE_AVX2;
+#endif
+#endif
+    return features;
+}
+
+uint32_t get_nb_cores(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(info.dwNumberOfProcessors, 1);
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (uint32_t)n;
+#endif
+}
+
+// Monotonic time in microseconds, for throughput reporting
+uint64_t get_time_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+typedef struct {
+    void (*func)(void*);
+    void* arg;
+} thread_data;
+
+#if defined(_WIN32)
+static DWORD WINAPI thread_proc(LPVOID param)
+{
+    thread_data* data = (thread_data*)param;
+    data->func(data->arg);
+    return 0;
+}
+#else
+static void* thread_proc(void* param)
+{
+    thread_data* data = (thread_data*)param;
+    data->func(data->arg);
+    return NULL;
+}
+#endif
+
+// Run func(arg) on nb_threads threads (including the calling one) and wait for all
+// of them to complete. func is expected to pull its work items from arg, so that a
+// thread we failed to create only means that the others end up doing more work.
+void run_threads(uint32_t nb_threads, void (*func)(void*), void* arg)
+{
+    thread_data data = { func, arg };
+    uint32_t nb_created = 0;
+#if defined(_WIN32)
+    HANDLE* threads = calloc(nb_threads, sizeof(HANDLE));
+#else
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+#endif
+
+    for (uint32_t i = 1; (threads != NULL) && (i < nb_threads); i++) {
+#if defined(_WIN32)
+        threads[nb_created] = CreateThread(NULL, 0, thread_proc, &data, 0, NULL);
+        if (threads[nb_created] == NULL)
+            break;
+#else
+        if (pthread_create(&threads[nb_created], NULL, thread_proc, &data) != 0)
+            break;
+#endif
+        nb_created++;
+    }
+    func(arg);
+    for (uint32_t i = 0; i < nb_created; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(threads);
+}
+
 bool is_file(const char* path)
 {
     struct stat64 st;
@@ -94,6 +225,32 @@ size_t get_trailing_slash(const char* path)
     return (i == 0) ? 0: i + 1;
 }
 
+// Match a path against a pattern where '*' matches any sequence of characters (path
+// separators included) and '?' any single character. Case and separator insensitive.
+bool match_glob(const char* pattern, const char* path)
+{
+    const char *star_pattern = NULL, *star_path = NULL;
+    while (*path != 0) {
+        if (*pattern == '*') {
+            star_pattern = ++pattern;
+            star_path = path;
+        } else if ((*pattern == '?') || ((*pattern != 0) &&
+            (normalize_path_char(*pattern) == normalize_path_char(*path)))) {
+            pattern++;
+            path++;
+        } else if (star_pattern != NULL) {
+            // Backtrack, with the last '*' matching one more character
+            pattern = star_pattern;
+            path = ++star_path;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return (*pattern == 0);
+}
+
 uint32_t read_file(const char* path, uint8_t** buf)
 {
     FILE* file = fopen_utf8(path, "rb");
@@ -124,6 +281,68 @@ out:
     return size;
 }
 
+bool map_file(const char* path, mapped_file* map)
+{
+    memset(map, 0, sizeof(*map));
+#if defined(_WIN32)
+    wchar_t* path16 = utf8_to_utf16(path);
+    map->file = CreateFileW(path16, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    free(path16);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        map->file = NULL;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size) || (size.QuadPart == 0) || ((uint64_t)size.QuadPart > SIZE_MAX))
+        goto fail;
+    map->size = (uint64_t)size.QuadPart;
+    map->mapping = CreateFileMappingW(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map->mapping == NULL)
+        goto fail;
+    map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (map->data == NULL)
+        goto fail;
+    return true;
+fail:
+    unmap_file(map);
+    return false;
+#else
+    struct stat64 st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    // 32-bit platforms may not be able to map large files, in which case we fail
+    if ((fstat64(fd, &st) != 0) || (st.st_size == 0) || ((uint64_t)st.st_size > SIZE_MAX)) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    map->data = data;
+    map->size = (uint64_t)st.st_size;
+    return true;
+#endif
+}
+
+void unmap_file(mapped_file* map)
+{
+#if defined(_WIN32)
+    if (map->data != NULL)
+        UnmapViewOfFile(map->data);
+    if (map->mapping != NULL)
+        CloseHandle(map->mapping);
+    if (map->file != NULL)
+        CloseHandle(map->file);
+#else
+    if (map->data != NULL)
+        munmap(map->data, (size_t)map->size);
+#endif
+    memset(map, 0, sizeof(*map));
+}
+
 void create_backup(const char* path)
 {
     struct stat64 st;
@@ -158,3 +377,493 @@ bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const
         fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
     return r;
 }
+
+// Append a copy of a path to a list of paths, growing the list as needed
+static bool add_path(const char* path, char*** paths, uint32_t* nb_paths, uint32_t* max_paths)
+{
+    if (*nb_paths >= *max_paths) {
+        uint32_t new_max = max(*max_paths * 2, 16);
+        char** new_paths = realloc(*paths, (size_t)new_max * sizeof(char*));
+        if (new_paths == NULL)
+            return false;
+        *paths = new_paths;
+        *max_paths = new_max;
+    }
+    (*paths)[*nb_paths] = _strdup(path);
+    if ((*paths)[*nb_paths] == NULL)
+        return false;
+    (*nb_paths)++;
+    return true;
+}
+
+// Add the paths listed in a file, one per line, to a list of paths
+static bool add_listed_paths(FILE* list, char*** paths, uint32_t* nb_paths, uint32_t* max_paths)
+{
+    char line[4096];
+    while (fgets(line, sizeof(line), list) != NULL) {
+        size_t len = strlen(line);
+        while ((len > 0) && ((line[len - 1] == '\r') || (line[len - 1] == '\n')))
+            line[--len] = 0;
+        if (len == 0)
+            continue;
+        if (!add_path(line, paths, nb_paths, max_paths))
+            return false;
+    }
+    return true;
+}
+
+bool list_files(const char* dir, char*** paths, uint32_t* nb_paths, uint32_t* max_paths)
+{
+    bool r = false;
+    size_t dir_len = strlen(dir);
+    while ((dir_len > 1) && ((dir[dir_len - 1] == '/') || (dir[dir_len - 1] == '\\')))
+        dir_len--;
+    // Room for the directory, a separator, a file name of up to 255 UTF-16 characters
+    // converted to UTF-8, and a wildcard on Windows
+    char* path = malloc(dir_len + 1 + 3 * 256 + 2);
+    if (path == NULL)
+        return false;
+    memcpy(path, dir, dir_len);
+    path[dir_len++] = PATH_SEP;
+
+#if defined(_WIN32)
+    WIN32_FIND_DATAW fd;
+    strcpy(&path[dir_len], "*");
+    wchar_t* pattern16 = utf8_to_utf16(path);
+    HANDLE h = (pattern16 == NULL) ? INVALID_HANDLE_VALUE : FindFirstFileW(pattern16, &fd);
+    free(pattern16);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "ERROR: Can't open directory '%s'\n", dir);
+        goto out;
+    }
+    r = true;
+    do {
+        if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+            continue;
+        char* name = utf16_to_utf8(fd.cFileName);
+        if (name == NULL) {
+            r = false;
+            break;
+        }
+        strcpy(&path[dir_len], name);
+        free(name);
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            r = list_files(path, paths, nb_paths, max_paths);
+        else
+            r = add_path(path, paths, nb_paths, max_paths);
+    } while (r && FindNextFileW(h, &fd));
+    if (r && (GetLastError() != ERROR_NO_MORE_FILES))
+        r = false;
+    FindClose(h);
+#else
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "ERROR: Can't open directory '%s'\n", dir);
+        goto out;
+    }
+    struct dirent* de;
+    r = true;
+    while (r && ((de = readdir(d)) != NULL)) {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
+            continue;
+        strcpy(&path[dir_len], de->d_name);
+        if (is_directory(path))
+            r = list_files(path, paths, nb_paths, max_paths);
+        else if (is_file(path))
+            r = add_path(path, paths, nb_paths, max_paths);
+    }
+    closedir(d);
+#endif
+
+out:
+    free(path);
+    return r;
+}
+
+int process_batch(int argc, char** argv, const char* arg_options, int (*process)(int, char**))
+{
+    int r = 0, argn;
+    uint32_t nb_paths = 0, max_paths = argc + 16, nb_failed = 0;
+    char** paths = calloc(max_paths, sizeof(char*));
+    char** args = calloc((size_t)argc + 1, sizeof(char*));
+
+    if ((paths == NULL) || (args == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate paths\n");
+        r = -1;
+        goto out;
+    }
+
+    // Options come first, and are passed along with each path
+    for (argn = 1; (argn < argc) && (argv[argn][0] == '-') && (argv[argn][1] != 0); argn++) {
+        if ((argv[argn][2] == 0) && (strchr(arg_options, argv[argn][1]) != NULL) && (argn + 1 < argc - 1))
+            argn++;
+    }
+    // A single path (or none, to display the usage) is processed as is, unless it is a list
+    if ((argn >= argc) || ((argn == argc - 1) && (argv[argn][0] != '@') &&
+        ((argv[argn][0] != '-') || (argv[argn][1] != 0)))) {
+        r = process(argc, argv);
+        goto out;
+    }
+    for (int i = 0; i < argn; i++)
+        args[i] = argv[i];
+
+    for (int i = argn; i < argc; i++) {
+        if ((argv[i][0] == '-') && (argv[i][1] == 0)) {
+            if (!add_listed_paths(stdin, &paths, &nb_paths, &max_paths))
+                r = -1;
+        } else if (argv[i][0] == '@') {
+            FILE* list = fopen_utf8(&argv[i][1], "r");
+            if (list == NULL) {
+                fprintf(stderr, "ERROR: Can't open list '%s'\n", &argv[i][1]);
+                r = -1;
+                continue;
+            }
+            if (!add_listed_paths(list, &paths, &nb_paths, &max_paths))
+                r = -1;
+            fclose(list);
+        } else if (!add_path(argv[i], &paths, &nb_paths, &max_paths)) {
+            r = -1;
+        }
+    }
+    if (r != 0) {
+        fprintf(stderr, "ERROR: Can't read list of paths\n");
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < nb_paths; i++) {
+        args[argn] = paths[i];
+        if (process(argn + 1, args) != 0)
+            nb_failed++;
+        printf("\n");
+    }
+    printf("Processed %u file(s)", nb_paths);
+    if (nb_failed != 0) {
+        printf(", %u failed", nb_failed);
+        r = -1;
+    }
+    printf("\n");
+
+out:
+    for (uint32_t i = 0; (paths != NULL) && (i < nb_paths); i++)
+        free(paths[i]);
+    free(paths);
+    free(args);
+    return r;
+}
+
+struct arena_block {
+    arena_block* next;
+    size_t size;
+    size_t used;
+};
+
+// Blocks are at least this large, and allocations are 16-byte aligned
+#define ARENA_BLOCK_SIZE    (1024 * 1024)
+#define ARENA_ALIGN(x)      (((x) + 15) & ~(size_t)15)
+#define ARENA_DATA(b)       ((uint8_t*)(b) + ARENA_ALIGN(sizeof(arena_block)))
+
+static arena_block* arena_new_block(size_t size)
+{
+    arena_block* b = malloc(ARENA_ALIGN(sizeof(arena_block)) + size);
+    if (b != NULL) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+void* arena_alloc(arena* a, size_t size)
+{
+    size = ARENA_ALIGN(max(size, 1));
+    if (a->current == NULL) {
+        if (a->first == NULL)
+            a->first = arena_new_block(max(size, ARENA_BLOCK_SIZE));
+        a->current = a->first;
+        if (a->current == NULL)
+            return NULL;
+        a->current->used = 0;
+    }
+    // Blocks that follow the current one were released by a rewind, so they can be reused
+    while (a->current->used + size > a->current->size) {
+        if (a->current->next == NULL) {
+            a->current->next = arena_new_block(max(size, max(a->current->size, ARENA_BLOCK_SIZE)));
+            if (a->current->next == NULL)
+                return NULL;
+        }
+        a->current = a->current->next;
+        a->current->used = 0;
+    }
+    void* p = ARENA_DATA(a->current) + a->current->used;
+    a->current->used += size;
+    return p;
+}
+
+arena_pos arena_save(const arena* a)
+{
+    arena_pos pos = { a->current, (a->current == NULL) ? 0 : a->current->used };
+    return pos;
+}
+
+// Release everything that was allocated since the position was saved
+void arena_restore(arena* a, arena_pos pos)
+{
+    a->current = pos.block;
+    if (pos.block != NULL)
+        pos.block->used = pos.used;
+}
+
+void arena_reset(arena* a)
+{
+    size_t total = 0;
+    a->current = NULL;
+    if ((a->first == NULL) || (a->first->next == NULL))
+        return;
+    for (arena_block* b = a->first; b != NULL; b = b->next)
+        total += b->size;
+    arena_free(a);
+    a->first = arena_new_block(total);
+}
+
+void arena_free(arena* a)
+{
+    arena_block* next;
+    for (arena_block* b = a->first; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->first = NULL;
+    a->current = NULL;
+}
+
+// Adler-32, with the modulo deferred for as long as the sums can't overflow
+#define ADLER32_MOD     65521
+#define ADLER32_NMAX    5552
+
+static uint32_t adler32_generic(uint32_t adler, const uint8_t* p, size_t len)
+{
+    uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+    while (len != 0) {
+        size_t n = min(len, ADLER32_NMAX);
+        len -= n;
+        for (; n >= 8; n -= 8, p += 8) {
+            s1 += p[0]; s2 += s1;
+            s1 += p[1]; s2 += s1;
+            s1 += p[2]; s2 += s1;
+            s1 += p[3]; s2 += s1;
+            s1 += p[4]; s2 += s1;
+            s1 += p[5]; s2 += s1;
+            s1 += p[6]; s2 += s1;
+            s1 += p[7]; s2 += s1;
+        }
+        for (; n != 0; n--) {
+            s1 += *p++;
+            s2 += s1;
+        }
+        s1 %= ADLER32_MOD;
+        s2 %= ADLER32_MOD;
+    }
+    return (s2 << 16) | s1;
+}
+
+#if defined(USE_X86_SIMD)
+#include <immintrin.h>
+
+// For each 32-byte block, s1 gets the sum of the bytes (SAD against zero) and s2 gets
+// the sum of the bytes weighted 32..1 plus 32 times the s1 of the previous blocks.
+TARGET_SSSE3 static uint32_t adler32_ssse3(uint32_t adler, const uint8_t* p, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i taps_hi = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i taps_lo = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+    while (len >= 32) {
+        size_t n = min(len, ADLER32_NMAX) / 32;
+        __m128i v_s1 = zero, v_s2 = zero, v_ps = zero;
+        len -= n * 32;
+        s2 += s1 * (uint32_t)n * 32;
+        do {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+            __m128i v1 = _mm_loadu_si128((const __m128i*)&p[16]);
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(v0, zero), _mm_sad_epu8(v1, zero)));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(v0, taps_hi), ones));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(v1, taps_lo), ones));
+            p += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+        // Horizontal sums
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        s1 += (uint32_t)_mm_cvtsi128_si32(v_s1);
+        s2 += (uint32_t)_mm_cvtsi128_si32(v_s2);
+        s1 %= ADLER32_MOD;
+        s2 %= ADLER32_MOD;
+    }
+    return adler32_generic((s2 << 16) | s1, p, len);
+}
+
+TARGET_AVX2 static uint32_t adler32_avx2(uint32_t adler, const uint8_t* p, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i taps = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+    while (len >= 32) {
+        size_t n = min(len, ADLER32_NMAX) / 32;
+        __m256i v_s1 = zero, v_s2 = zero, v_ps = zero;
+        len -= n * 32;
+        s2 += s1 * (uint32_t)n * 32;
+        do {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(v, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, taps), ones));
+            p += 32;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+        // Horizontal sums
+        __m128i h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+        __m128i h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        s1 += (uint32_t)_mm_cvtsi128_si32(h_s1);
+        s2 += (uint32_t)_mm_cvtsi128_si32(h_s2);
+        s1 %= ADLER32_MOD;
+        s2 %= ADLER32_MOD;
+    }
+    return adler32_generic((s2 << 16) | s1, p, len);
+}
+#endif
+
+static uint32_t adler32_select(uint32_t adler, const uint8_t* p, size_t len);
+static uint32_t (*adler32_impl)(uint32_t adler, const uint8_t* p, size_t len) = adler32_select;
+
+// Picks the implementation on first use. Concurrent first calls all store the same value.
+static uint32_t adler32_select(uint32_t adler, const uint8_t* p, size_t len)
+{
+    uint32_t (*impl)(uint32_t, const uint8_t*, size_t) = adler32_generic;
+#if defined(USE_X86_SIMD)
+    uint32_t features = get_cpu_features();
+    if (features & CPU_FEATURE_AVX2)
+        impl = adler32_avx2;
+    else if (features & CPU_FEATURE_SSSE3)
+        impl = adler32_ssse3;
+#endif
+    adler32_impl = impl;
+    return impl(adler, p, len);
+}
+
+uint32_t adler32(uint32_t adler, const void* data, size_t len)
+{
+    return adler32_impl(adler, (const uint8_t*)data, len);
+}
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+
+static __inline uint64_t rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static __inline uint64_t read_le64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return getle64(&v);
+}
+
+static __inline uint32_t read_le32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return getle32(&v);
+}
+
+static __inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static __inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh64_round(0, v)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_init(xxh64_state* state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64_update(xxh64_state* state, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+
+    state->total_len += len;
+    if (state->buf_len + len < 32) {
+        memcpy(&state->buf[state->buf_len], p, len);
+        state->buf_len += (uint32_t)len;
+        return;
+    }
+    if (state->buf_len != 0) {
+        memcpy(&state->buf[state->buf_len], p, 32 - state->buf_len);
+        p += 32 - state->buf_len;
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh64_round(state->v[i], read_le64(&state->buf[8 * i]));
+        state->buf_len = 0;
+    }
+    for (; p + 32 <= end; p += 32) {
+        state->v[0] = xxh64_round(state->v[0], read_le64(p));
+        state->v[1] = xxh64_round(state->v[1], read_le64(p + 8));
+        state->v[2] = xxh64_round(state->v[2], read_le64(p + 16));
+        state->v[3] = xxh64_round(state->v[3], read_le64(p + 24));
+    }
+    state->buf_len = (uint32_t)(end - p);
+    memcpy(state->buf, p, state->buf_len);
+}
+
+uint64_t xxh64_digest(const xxh64_state* state)
+{
+    uint64_t h;
+    const uint8_t* p = state->buf;
+    const uint8_t* end = p + state->buf_len;
+
+    if (state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge_round(h, state->v[i]);
+    } else {
+        // v[2] holds the seed as long as no full stripe was processed
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh64_round(0, read_le64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (read_le32(p) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -54,6 +54,7 @@
 #define fseek64 fseeko64
 #define CREATE_DIR(path) (mkdir(path, 0755) == 0)
 #define PATH_SEP '/'
+#define _strdup strdup
 #endif
 
 #ifndef min
@@ -89,6 +90,41 @@ static __inline char* _basename(const char* path, bool remove_extension)
 #define appname(path) basename(path)
 #endif
 
+// SIMD code paths are selected at runtime, according to the CPU features
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define USE_X86_SIMD
+#define CPU_FEATURE_SSE2    0x01
+#define CPU_FEATURE_SSSE3   0x02
+#define CPU_FEATURE_AVX2    0x04
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Atomically increment a value and return the value it had prior to the increment
+static __inline uint32_t atomic_fetch_inc(volatile uint32_t* v)
+{
+#if defined(_WIN32)
+    return (uint32_t)InterlockedIncrement((volatile LONG*)v) - 1;
+#else
+    return __atomic_fetch_add(v, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Normalize a path character, for case and separator insensitive comparisons
+static __inline char normalize_path_char(char c)
+{
+    if (c == '\\')
+        return '/';
+    return ((c >= 'A') && (c <= 'Z')) ? c - 'A' + 'a' : c;
+}
+
 #if defined (_MSC_VER)
 #include <stdlib.h>
 #define bswap_uint16 _byteswap_ushort
@@ -202,10 +238,74 @@ static __inline void setbe64(const void* p, const uint64_t v)
 bool create_path(char* path);
 char* change_extension(const char* path, const char* extension);
 size_t get_trailing_slash(const char* path);
+bool match_glob(const char* pattern, const char* path);
+
+uint32_t get_cpu_features(void);
+uint32_t get_nb_cores(void);
+uint64_t get_time_us(void);
+void run_threads(uint32_t nb_threads, void (*func)(void*), void* arg);
+
+// Call a tool's processing function for each of the paths from the command line, where
+// "@list" adds the paths listed in a file, and "-" the ones read from stdin. Leading
+// options are passed to every call, and arg_options lists the ones that take a value.
+// Files are processed one after the other, each with its own thread pool and buffers.
+int process_batch(int argc, char** argv, const char* arg_options, int (*process)(int, char**));
+
+// Recursively add the paths of all the files found under a directory to a list of
+// paths, which is reallocated as needed. Paths are in directory enumeration order.
+bool list_files(const char* dir, char*** paths, uint32_t* nb_paths, uint32_t* max_paths);
 
 bool is_file(const char* path);
 bool is_directory(const char* path);
 
+// Read-only memory mapping of a whole file
+typedef struct {
+    uint8_t* data;
+    uint64_t size;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file;
+
+// Scratch arena for transient buffers. Memory is handed out from large blocks and is
+// only given back by rewinding to a saved position, or with arena_reset(), which also
+// merges the blocks, so that the next archive can be processed without any allocation.
+typedef struct arena_block arena_block;
+typedef struct {
+    arena_block* first;
+    arena_block* current;
+} arena;
+
+typedef struct {
+    arena_block* block;
+    size_t used;
+} arena_pos;
+
+void* arena_alloc(arena* a, size_t size);
+arena_pos arena_save(const arena* a);
+void arena_restore(arena* a, arena_pos pos);
+void arena_reset(arena* a);
+void arena_free(arena* a);
+
+// Streaming xxHash64 state
+typedef struct {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t  buf[32];
+    uint32_t buf_len;
+} xxh64_state;
+
+void xxh64_init(xxh64_state* state, uint64_t seed);
+void xxh64_update(xxh64_state* state, const void* data, size_t len);
+uint64_t xxh64_digest(const xxh64_state* state);
+
+// Update a running Adler-32 checksum, which must start at 1. This uses SIMD when the
+// CPU supports it, and is also what miniz uses to check and produce zlib streams.
+uint32_t adler32(uint32_t adler, const void* data, size_t len);
+
 uint32_t read_file(const char* path, uint8_t** buf);
+bool map_file(const char* path, mapped_file* map);
+void unmap_file(mapped_file* map);
 void create_backup(const char* path);
 bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const bool backup);